@@ -0,0 +1,726 @@
+/*
+  concatfs_bench: benchmark harness for the concatfs read paths
+
+  Generates a synthetic source tree, mounts concatfs on top of it and
+  measures a fixed set of workloads:
+
+  - seq:      sequential throughput of one concat file, 1 MiB reads
+  - rand4k:   random 4 KiB read IOPS
+  - rand128k: random 128 KiB read IOPS
+  - getattr:  stat latency on a directory full of manifests
+  - readdir:  latency of listing that directory
+  - open:     open/close latency against manifest length
+  - clients:  aggregate sequential throughput with N concurrent readers
+
+  The read workloads also run against a physically concatenated copy
+  of the chunks ("flat"), read straight from the source tree. That's the
+  baseline concatfs should come close to. Results go to stdout as JSON.
+
+  Passing "-" instead of the concatfs binary skips mounting and runs the
+  concat workloads on the source tree, which only checks the harness.
+
+  gcc -Wall -O2 -pthread concatfs_bench.c -o concatfs_bench
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+struct bench_options {
+	unsigned int chunks;
+	size_t chunk_size;
+	unsigned int manifests;
+	unsigned int clients;
+	unsigned int rand_ops;
+	unsigned int rounds;
+	const char * mount_opts;
+};
+
+static struct bench_options options = {
+	.chunks = 256,
+	.chunk_size = 4 << 20,
+	.manifests = 1000,
+	.clients = 8,
+	.rand_ops = 20000,
+	.rounds = 200,
+	.mount_opts = 0,
+};
+
+/* leaves room below them for the longest name the harness creates */
+#define ROOT_MAX (PATH_MAX - 64)
+
+static char src_dir[ROOT_MAX];
+static char mnt_dir[ROOT_MAX];
+static pid_t concatfs_pid = 0;
+
+static int first_result = 1;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char * what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* formats a path into buf, paths that don't fit are fatal */
+__attribute__((format(printf, 3, 4)))
+static void make_path(char * buf, size_t size, const char * fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || (size_t) n >= size) {
+		fprintf(stderr, "concatfs_bench: path too long\n");
+		exit(1);
+	}
+}
+
+static void write_file(const char * path, size_t size, unsigned int seed)
+{
+	char buf[65536];
+	size_t done = 0;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		die(path);
+	}
+
+	while (done < size) {
+		size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+		size_t i;
+
+		for (i = 0; i < n; i++) {
+			seed = seed * 1103515245 + 12345;
+			buf[i] = seed >> 16;
+		}
+
+		if (write(fd, buf, n) != (ssize_t) n) {
+			die(path);
+		}
+
+		done += n;
+	}
+
+	close(fd);
+}
+
+static void append_file(int dst, const char * path)
+{
+	char buf[65536];
+	ssize_t n;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		die(path);
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (write(dst, buf, n) != n) {
+			die("flat.bin");
+		}
+	}
+
+	close(fd);
+}
+
+/* writes a manifest listing the first n chunks */
+static void write_manifest(const char * path, unsigned int n)
+{
+	FILE * fp = fopen(path, "w");
+	unsigned int i;
+
+	if (!fp) {
+		die(path);
+	}
+
+	for (i = 0; i < n; i++) {
+		fprintf(fp, "chunk%05u.bin\n", i);
+	}
+
+	fclose(fp);
+}
+
+static void generate_tree(const char * work_dir)
+{
+	char path[PATH_MAX];
+	unsigned int i;
+	unsigned int n;
+	int flat;
+
+	make_path(src_dir, sizeof(src_dir), "%s/src", work_dir);
+	make_path(mnt_dir, sizeof(mnt_dir), "%s/mnt", work_dir);
+
+	mkdir(work_dir, 0755);
+	mkdir(src_dir, 0755);
+	mkdir(mnt_dir, 0755);
+
+	make_path(path, sizeof(path), "%s/flat.bin", src_dir);
+	flat = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (flat < 0) {
+		die(path);
+	}
+
+	for (i = 0; i < options.chunks; i++) {
+		make_path(path, sizeof(path), "%s/chunk%05u.bin", src_dir, i);
+		write_file(path, options.chunk_size, i + 1);
+		append_file(flat, path);
+	}
+
+	close(flat);
+
+	make_path(path, sizeof(path), "%s/bench-concat-all.bin", src_dir);
+	write_manifest(path, options.chunks);
+
+	make_path(path, sizeof(path), "%s/dir", src_dir);
+	mkdir(path, 0755);
+
+	for (i = 0; i < options.manifests; i++) {
+		FILE * fp;
+
+		make_path(path, sizeof(path), "%s/dir/m%05u-concat-.bin",
+			 src_dir, i);
+		fp = fopen(path, "w");
+		if (!fp) {
+			die(path);
+		}
+		for (n = 0; n < 16 && n < options.chunks; n++) {
+			fprintf(fp, "../chunk%05u.bin\n",
+				(i + n) % options.chunks);
+		}
+		fclose(fp);
+	}
+
+	for (n = 1; n <= options.chunks; n *= 4) {
+		make_path(path, sizeof(path), "%s/open%05u-concat-.bin",
+			 src_dir, n);
+		write_manifest(path, n);
+	}
+}
+
+static void drop_source_cache()
+{
+	char path[PATH_MAX];
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < options.chunks; i++) {
+		make_path(path, sizeof(path), "%s/chunk%05u.bin", src_dir, i);
+		if ((fd = open(path, O_RDONLY)) >= 0) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+
+	make_path(path, sizeof(path), "%s/flat.bin", src_dir);
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static int is_mounted()
+{
+	struct stat a;
+	struct stat b;
+	char parent[PATH_MAX];
+
+	make_path(parent, sizeof(parent), "%s/..", mnt_dir);
+
+	return stat(mnt_dir, &a) == 0 && stat(parent, &b) == 0
+		&& a.st_dev != b.st_dev;
+}
+
+static void mount_concatfs(const char * concatfs)
+{
+	int i;
+
+	concatfs_pid = fork();
+
+	if (concatfs_pid < 0) {
+		die("fork");
+	}
+
+	if (concatfs_pid == 0) {
+		if (options.mount_opts) {
+			execl(concatfs, concatfs, src_dir, mnt_dir, "-f",
+			      "-o", options.mount_opts, (char *) 0);
+		} else {
+			execl(concatfs, concatfs, src_dir, mnt_dir, "-f",
+			      (char *) 0);
+		}
+		die(concatfs);
+	}
+
+	for (i = 0; i < 100 && !is_mounted(); i++) {
+		usleep(100000);
+	}
+
+	if (!is_mounted()) {
+		fprintf(stderr, "concatfs_bench: mount didn't show up\n");
+		kill(concatfs_pid, SIGTERM);
+		exit(1);
+	}
+}
+
+static void unmount_concatfs()
+{
+	char cmd[PATH_MAX + 32];
+
+	if (!concatfs_pid) {
+		return;
+	}
+
+	snprintf(cmd, sizeof(cmd), "fusermount3 -u '%s'", mnt_dir);
+
+	if (system(cmd) != 0) {
+		kill(concatfs_pid, SIGTERM);
+	}
+
+	waitpid(concatfs_pid, 0, 0);
+}
+
+static void result_begin(const char * workload, const char * target)
+{
+	printf("%s\n    { \"workload\": \"%s\", \"target\": \"%s\"",
+	       first_result ? "" : ",", workload, target);
+	first_result = 0;
+}
+
+static void result_end()
+{
+	printf(" }");
+	fflush(stdout);
+}
+
+static int compare_double(const void * a, const void * b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* prints mean and percentiles of n latencies in seconds, sorts them */
+static void result_latencies(double * lat, size_t n)
+{
+	double sum = 0;
+	size_t i;
+
+	qsort(lat, n, sizeof(double), compare_double);
+
+	for (i = 0; i < n; i++) {
+		sum += lat[i];
+	}
+
+	printf(", \"ops\": %zu, \"mean_us\": %.2f, \"p50_us\": %.2f, "
+	       "\"p99_us\": %.2f, \"max_us\": %.2f",
+	       n, sum / n * 1e6, lat[n / 2] * 1e6, lat[n * 99 / 100] * 1e6,
+	       lat[n - 1] * 1e6);
+}
+
+static off_t file_size(const char * path)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		die(path);
+	}
+
+	return st.st_size;
+}
+
+static void bench_seq(const char * target, const char * path)
+{
+	size_t bs = 1 << 20;
+	char * buf = malloc(bs);
+	off_t total = 0;
+	double t;
+	ssize_t n;
+	int fd;
+
+	drop_source_cache();
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		die(path);
+	}
+
+	t = now();
+	while ((n = read(fd, buf, bs)) > 0) {
+		total += n;
+	}
+	t = now() - t;
+
+	close(fd);
+	free(buf);
+
+	result_begin("seq", target);
+	printf(", \"bytes\": %lld, \"seconds\": %.3f, \"mib_per_s\": %.1f",
+	       (long long) total, t, total / t / (1 << 20));
+	result_end();
+}
+
+static void bench_rand(const char * workload, const char * target,
+		       const char * path, size_t bs)
+{
+	off_t size = file_size(path);
+	double * lat;
+	char * buf;
+	unsigned int seed = 1;
+	unsigned int i;
+	double t;
+	int fd;
+
+	if (size < (off_t) bs) {
+		return;
+	}
+
+	lat = malloc(options.rand_ops * sizeof(double));
+	buf = malloc(bs);
+
+	drop_source_cache();
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		die(path);
+	}
+
+	t = now();
+	for (i = 0; i < options.rand_ops; i++) {
+		off_t offset = ((off_t) rand_r(&seed) << 16 ^ rand_r(&seed))
+			% (size - bs + 1);
+		double t0 = now();
+
+		if (pread(fd, buf, bs, offset) < 0) {
+			die(path);
+		}
+
+		lat[i] = now() - t0;
+	}
+	t = now() - t;
+
+	close(fd);
+
+	result_begin(workload, target);
+	printf(", \"block_size\": %zu, \"iops\": %.0f", bs,
+	       options.rand_ops / t);
+	result_latencies(lat, options.rand_ops);
+	result_end();
+
+	free(buf);
+	free(lat);
+}
+
+static void bench_getattr(const char * target, const char * root)
+{
+	size_t n = (size_t) options.manifests * 4;
+	double * lat = malloc(n * sizeof(double));
+	char path[PATH_MAX];
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		double t0;
+
+		make_path(path, sizeof(path), "%s/dir/m%05zu-concat-.bin",
+			 root, i % options.manifests);
+
+		t0 = now();
+		if (stat(path, &st) != 0) {
+			die(path);
+		}
+		lat[i] = now() - t0;
+	}
+
+	result_begin("getattr", target);
+	result_latencies(lat, n);
+	result_end();
+
+	free(lat);
+}
+
+/* lists the manifest directory and stats every entry, like ls -l */
+static void bench_readdir(const char * target, const char * root)
+{
+	double * lat = malloc(options.rounds * sizeof(double));
+	char path[PATH_MAX];
+	unsigned int i;
+
+	make_path(path, sizeof(path), "%s/dir", root);
+
+	for (i = 0; i < options.rounds; i++) {
+		DIR * dp;
+		struct dirent * de;
+		struct stat st;
+		double t0 = now();
+
+		dp = opendir(path);
+		if (!dp) {
+			die(path);
+		}
+
+		while ((de = readdir(dp))) {
+			fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW);
+		}
+
+		closedir(dp);
+
+		lat[i] = now() - t0;
+	}
+
+	result_begin("readdir", target);
+	printf(", \"entries\": %u", options.manifests);
+	result_latencies(lat, options.rounds);
+	result_end();
+
+	free(lat);
+}
+
+/* opens each manifest length once cold (after a change) and then warm */
+static void bench_open(const char * target, const char * root)
+{
+	double * lat = malloc(options.rounds * sizeof(double));
+	char path[PATH_MAX];
+	char spath[PATH_MAX];
+	unsigned int n;
+	unsigned int i;
+
+	for (n = 1; n <= options.chunks; n *= 4) {
+		double cold;
+		char c;
+		int fd;
+
+		make_path(path, sizeof(path), "%s/open%05u-concat-.bin",
+			  root, n);
+		make_path(spath, sizeof(spath), "%s/open%05u-concat-.bin",
+			 src_dir, n);
+
+		/* rewriting the manifest makes the next open a cold one */
+		write_manifest(spath, n);
+
+		cold = now();
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || pread(fd, &c, 1, 0) < 0) {
+			die(path);
+		}
+		close(fd);
+		cold = now() - cold;
+
+		for (i = 0; i < options.rounds; i++) {
+			double t0 = now();
+
+			fd = open(path, O_RDONLY);
+			if (fd < 0 || pread(fd, &c, 1, 0) < 0) {
+				die(path);
+			}
+			close(fd);
+
+			lat[i] = now() - t0;
+		}
+
+		result_begin("open", target);
+		printf(", \"manifest_length\": %u, \"cold_us\": %.2f", n,
+		       cold * 1e6);
+		result_latencies(lat, options.rounds);
+		result_end();
+	}
+
+	free(lat);
+}
+
+struct client {
+	pthread_t thread;
+	const char * path;
+	off_t offset;
+	off_t len;
+	off_t bytes;
+};
+
+static void * client_run(void * arg)
+{
+	struct client * c = (struct client *) arg;
+	size_t bs = 1 << 20;
+	char * buf = malloc(bs);
+	off_t offset = c->offset;
+	int fd = open(c->path, O_RDONLY);
+
+	if (fd < 0) {
+		die(c->path);
+	}
+
+	while (offset < c->offset + c->len) {
+		ssize_t n = pread(fd, buf, bs, offset);
+
+		if (n <= 0) {
+			break;
+		}
+
+		offset += n;
+		c->bytes += n;
+	}
+
+	close(fd);
+	free(buf);
+
+	return 0;
+}
+
+/* n clients each stream their own slice of the file */
+static void bench_clients(const char * target, const char * path)
+{
+	off_t size = file_size(path);
+	struct client * c = calloc(options.clients, sizeof(struct client));
+	unsigned int n;
+
+	for (n = 1; n <= options.clients; n *= 2) {
+		off_t total = 0;
+		unsigned int i;
+		double t;
+
+		drop_source_cache();
+
+		t = now();
+		for (i = 0; i < n; i++) {
+			c[i].path = path;
+			c[i].offset = size / n * i;
+			c[i].len = size / n;
+			c[i].bytes = 0;
+			pthread_create(&c[i].thread, 0, client_run, &c[i]);
+		}
+		for (i = 0; i < n; i++) {
+			pthread_join(c[i].thread, 0);
+			total += c[i].bytes;
+		}
+		t = now() - t;
+
+		result_begin("clients", target);
+		printf(", \"clients\": %u, \"bytes\": %lld, \"seconds\": %.3f, "
+		       "\"mib_per_s\": %.1f", n, (long long) total, t,
+		       total / t / (1 << 20));
+		result_end();
+	}
+
+	free(c);
+}
+
+static void usage()
+{
+	fprintf(stderr,
+		"Usage: concatfs_bench [options] concatfs-binary work-dir\n"
+		"\n"
+		"    -n N      chunks in the big concat file (256)\n"
+		"    -s MIB    size of each chunk in MiB (4)\n"
+		"    -m N      manifests in the getattr/readdir directory (1000)\n"
+		"    -c N      maximum number of concurrent clients (8)\n"
+		"    -r N      random reads per random workload (20000)\n"
+		"    -l N      rounds of the latency workloads (200)\n"
+		"    -o OPTS   mount options passed to concatfs\n"
+		"\n"
+		"Pass - as concatfs-binary to run without mounting.\n");
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	char flat[PATH_MAX];
+	char concat[PATH_MAX];
+	const char * root;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:m:c:r:l:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			options.chunks = atoi(optarg);
+			break;
+		case 's':
+			options.chunk_size = (size_t) atoi(optarg) << 20;
+			break;
+		case 'm':
+			options.manifests = atoi(optarg);
+			break;
+		case 'c':
+			options.clients = atoi(optarg);
+			break;
+		case 'r':
+			options.rand_ops = atoi(optarg);
+			break;
+		case 'l':
+			options.rounds = atoi(optarg);
+			break;
+		case 'o':
+			options.mount_opts = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (argc - optind != 2 || options.chunks == 0
+	    || options.chunk_size < (128 << 10) || options.manifests == 0
+	    || options.clients == 0 || options.rand_ops == 0
+	    || options.rounds == 0) {
+		usage();
+	}
+
+	generate_tree(argv[optind + 1]);
+
+	if (strcmp(argv[optind], "-") != 0) {
+		mount_concatfs(argv[optind]);
+		root = mnt_dir;
+	} else {
+		root = src_dir;
+	}
+
+	make_path(flat, sizeof(flat), "%s/flat.bin", src_dir);
+	make_path(concat, sizeof(concat), "%s/bench-concat-all.bin", root);
+
+	printf("{\n  \"chunks\": %u,\n  \"chunk_size\": %zu,\n"
+	       "  \"mount_options\": \"%s\",\n  \"results\": [",
+	       options.chunks, options.chunk_size,
+	       options.mount_opts ? options.mount_opts : "");
+
+	bench_seq("flat", flat);
+	bench_seq("concat", concat);
+	bench_rand("rand4k", "flat", flat, 4 << 10);
+	bench_rand("rand4k", "concat", concat, 4 << 10);
+	bench_rand("rand128k", "flat", flat, 128 << 10);
+	bench_rand("rand128k", "concat", concat, 128 << 10);
+	bench_getattr("concat", root);
+	bench_readdir("concat", root);
+	bench_open("concat", root);
+	bench_clients("flat", flat);
+	bench_clients("concat", concat);
+
+	printf("\n  ]\n}\n");
+
+	unmount_concatfs();
+
+	return 0;
+}
@@ -27,615 +27,8441 @@
   on seperate lines. Empty lines or lines, which do not resolve to a file where
   a stat call succeeds, are ignored.
 
-  gcc -Wall concatfs.c `pkg-config fuse --cflags --libs` -o concatfs
+  gcc -Wall concatfs.c `pkg-config fuse3 --cflags --libs` -o concatfs
 */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 312
+#define _GNU_SOURCE
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <pthread.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <dirent.h>
+#include <setjmp.h>
+#include <signal.h>
 
-static char src_dir[PATH_MAX];
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_CURL
+#include <curl/curl.h>
+#endif
+
+/*
+  All source paths are resolved relative to src_fd, an O_PATH fd of the
+  source directory opened once at startup. That keeps the kernel from
+  walking the source directory's own path on every call and keeps the
+  mount working when the source directory is renamed.
+*/
+
+static int src_fd = AT_FDCWD;
+
+struct concatfs_options {
+	unsigned int chunk_ttl;
+	unsigned int max_chunk_fds;
+	unsigned int prefetch;
+	char * io;
+	unsigned int io_threads;
+	int use_mmap;
+	char * hash_index;
+	int watch;
+	double attr_timeout;
+	double entry_timeout;
+	unsigned int zstd_cache;
+	unsigned int block_cache;
+	char * remote_cache;
+	unsigned int remote_ttl;
+	unsigned int remote_conns;
+	char * s3_endpoint;
+	char * state_file;
+	int warm;
+	int passthrough;
+};
+
+static struct concatfs_options options = {
+	.chunk_ttl = 1,
+	.attr_timeout = -1,
+	.entry_timeout = -1,
+	.zstd_cache = 64,
+	.remote_ttl = 60,
+	.remote_conns = 16,
+	.s3_endpoint = "https://s3.amazonaws.com",
+	.prefetch = 4,
+	.io_threads = 16,
+};
+
+enum io_mode {
+	IO_SYNC,
+	IO_POOL,
+	IO_URING,
+};
+
+static enum io_mode io_mode = IO_SYNC;
+
+/*
+  Runtime statistics, readable through the virtual file
+  /.concatfs/stats in Prometheus text format.
+
+  Every thread counts into its own thread_stats, so the hot paths don't
+  share any cache lines. Reading the stats file sums up all of them;
+  threads that exit fold their counts into retired_stats.
+
+  Latency histograms use power of two buckets from 1us up to 2^24us.
+*/
+
+#define STATS_DIR ".concatfs"
+#define STATS_FILE "stats"
+#define STATS_BUCKETS 26
+
+enum stat_op {
+	STAT_OPEN,
+	STAT_GETATTR,
+	STAT_READ,
+	STAT_READDIR,
+	STAT_CHUNK_PREAD,
+	STAT_REMOTE_GET,
+	STAT_NOPS
+};
+
+static const char * stat_op_names[STAT_NOPS] = {
+	"open", "getattr", "read", "readdir", "chunk_pread", "remote_get"
+};
+
+struct op_stats {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct thread_stats {
+	struct thread_stats * next;
+	struct op_stats ops[STAT_NOPS];
+
+	uint64_t read_bytes;
+	uint64_t manifest_parses;
+	uint64_t manifest_hits;
+	uint64_t hashed_bytes;
+	uint64_t digest_hits;
+	uint64_t zstd_frames;
+	uint64_t zstd_hits;
+	uint64_t block_hits;
+	uint64_t block_misses;
+	uint64_t remote_bytes;
+	uint64_t remote_cache_hits;
+	uint64_t state_hits;
+	uint64_t warmed;
+	uint64_t copied_bytes;
+	uint64_t cloned_bytes;
+};
+
+static struct thread_stats * all_stats = 0;
+static struct thread_stats retired_stats;
+static pthread_mutex_t stats_lock;
+static pthread_key_t stats_key;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* only the owning thread writes, readers may look at any time */
+static void stat_add(uint64_t * counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static void thread_stats_merge(struct thread_stats * dst,
+			       struct thread_stats * src)
+{
+	uint64_t * d = (uint64_t *) &dst->ops;
+	uint64_t * p = (uint64_t *) &src->ops;
+	uint64_t * end = (uint64_t *) (src + 1);
+
+	for (; p < end; p++, d++) {
+		*d += __atomic_load_n(p, __ATOMIC_RELAXED);
+	}
+}
+
+static void thread_stats_retire(void * p)
+{
+	struct thread_stats * ts = (struct thread_stats *) p;
+	struct thread_stats ** q;
+
+	pthread_mutex_lock(&stats_lock);
+
+	for (q = &all_stats; *q; q = &(*q)->next) {
+		if (*q == ts) {
+			*q = ts->next;
+			break;
+		}
+	}
+
+	thread_stats_merge(&retired_stats, ts);
+
+	pthread_mutex_unlock(&stats_lock);
+
+	free(ts);
+}
+
+static struct thread_stats * thread_stats_get()
+{
+	struct thread_stats * ts = pthread_getspecific(stats_key);
+
+	if (!ts) {
+		ts = (struct thread_stats *) calloc(
+			sizeof(struct thread_stats), 1);
+
+		pthread_mutex_lock(&stats_lock);
+		ts->next = all_stats;
+		all_stats = ts;
+		pthread_mutex_unlock(&stats_lock);
+
+		pthread_setspecific(stats_key, ts);
+	}
+
+	return ts;
+}
+
+static void stats_count(enum stat_op op, uint64_t start)
+{
+	struct op_stats * s = &thread_stats_get()->ops[op];
+	uint64_t ns = now_ns() - start;
+	uint64_t us = ns / 1000;
+	unsigned int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (bucket >= STATS_BUCKETS) {
+		bucket = STATS_BUCKETS - 1;
+	}
+
+	stat_add(&s->count, 1);
+	stat_add(&s->sum_ns, ns);
+	stat_add(&s->buckets[bucket], 1);
+}
+
+/* records the latency of an op started at start and returns rv */
+static int stats_done(enum stat_op op, uint64_t start, int rv)
+{
+	stats_count(op, start);
+
+	return rv;
+}
+
+#define CONCATFS_OPT(t, p) { t, offsetof(struct concatfs_options, p), 1 }
+
+static const struct fuse_opt concatfs_opts[] = {
+	CONCATFS_OPT("chunk_ttl=%u", chunk_ttl),
+	CONCATFS_OPT("max_chunk_fds=%u", max_chunk_fds),
+	CONCATFS_OPT("prefetch=%u", prefetch),
+	CONCATFS_OPT("io=%s", io),
+	CONCATFS_OPT("io_threads=%u", io_threads),
+	CONCATFS_OPT("mmap", use_mmap),
+	CONCATFS_OPT("hash_index=%s", hash_index),
+	CONCATFS_OPT("watch", watch),
+	CONCATFS_OPT("attr_timeout=%lf", attr_timeout),
+	CONCATFS_OPT("entry_timeout=%lf", entry_timeout),
+	CONCATFS_OPT("zstd_cache=%u", zstd_cache),
+	CONCATFS_OPT("block_cache=%u", block_cache),
+	CONCATFS_OPT("remote_cache=%s", remote_cache),
+	CONCATFS_OPT("remote_ttl=%u", remote_ttl),
+	CONCATFS_OPT("remote_conns=%u", remote_conns),
+	CONCATFS_OPT("s3_endpoint=%s", s3_endpoint),
+	CONCATFS_OPT("state_file=%s", state_file),
+	CONCATFS_OPT("warm", warm),
+	CONCATFS_OPT("passthrough", passthrough),
+	FUSE_OPT_END
+};
+
+/*
+  Small pools of worker threads for blocking work that can be done in
+  parallel. Callers queue tasks belonging to a task_group and wait for
+  the group, helping with its queued tasks in the meantime. Each group
+  runs on one pool: io_pool serves chunk reads and manifest stats,
+  digest_pool the whole-chunk hashes of digests, so those can't hold
+  the threads reads wait for.
+*/
+
+struct task_pool {
+	struct task * queue;
+	struct task ** tail;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int started;
+};
+
+struct task_group {
+	struct task_pool * pool;
+	int pending;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+struct task {
+	struct task * next;
+	struct task_group * group;
+
+	void (*fn)(struct task * t);
+};
+
+static struct task_pool io_pool;
+static struct task_pool digest_pool;
+
+static void task_pool_init(struct task_pool * p)
+{
+	p->queue = 0;
+	p->tail = &p->queue;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->started = 0;
+}
+
+static void task_group_init(struct task_group * g, struct task_pool * p)
+{
+	g->pool = p;
+	g->pending = 0;
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->done, NULL);
+}
+
+static void task_group_destroy(struct task_group * g)
+{
+	pthread_mutex_destroy(&g->lock);
+	pthread_cond_destroy(&g->done);
+}
+
+static void task_run(struct task * t)
+{
+	struct task_group * g = t->group;
+
+	t->fn(t);
+
+	pthread_mutex_lock(&g->lock);
+	if (--g->pending == 0) {
+		pthread_cond_signal(&g->done);
+	}
+	pthread_mutex_unlock(&g->lock);
+}
+
+static void task_submit(struct task_group * g, struct task * t)
+{
+	struct task_pool * p = g->pool;
+
+	pthread_mutex_lock(&g->lock);
+	g->pending++;
+	pthread_mutex_unlock(&g->lock);
+
+	t->group = g;
+	t->next = 0;
+
+	pthread_mutex_lock(&p->lock);
+	*p->tail = t;
+	p->tail = &t->next;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* called with p->lock held */
+static struct task * task_take(struct task_pool * p)
+{
+	struct task * t = p->queue;
+
+	if (t) {
+		p->queue = t->next;
+		if (!p->queue) {
+			p->tail = &p->queue;
+		}
+	}
+
+	return t;
+}
+
+/*
+  called with the pool's lock held, takes the first queued task of g.
+  Waiters only help with their own group, so a request never ends up
+  running someone else's long task.
+*/
+static struct task * task_take_group(struct task_group * g)
+{
+	struct task_pool * p = g->pool;
+	struct task ** q;
+	struct task * t;
+
+	for (q = &p->queue; (t = *q); q = &t->next) {
+		if (t->group == g) {
+			*q = t->next;
+			if (p->tail == &t->next) {
+				p->tail = q;
+			}
+			return t;
+		}
+	}
+
+	return 0;
+}
+
+static void task_group_wait(struct task_group * g)
+{
+	struct task * t;
+
+	for (;;) {
+		pthread_mutex_lock(&g->pool->lock);
+		t = task_take_group(g);
+		pthread_mutex_unlock(&g->pool->lock);
+
+		if (!t) {
+			break;
+		}
+
+		task_run(t);
+	}
+
+	pthread_mutex_lock(&g->lock);
+	while (g->pending > 0) {
+		pthread_cond_wait(&g->done, &g->lock);
+	}
+	pthread_mutex_unlock(&g->lock);
+}
+
+static void * task_worker(void * arg)
+{
+	struct task_pool * p = (struct task_pool *) arg;
+	struct task * t;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (!(t = task_take(p))) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		task_run(t);
+	}
+
+	return 0;
+}
+
+static void task_pool_start(struct task_pool * p, unsigned int nthreads)
+{
+	unsigned int i;
+
+	if (__atomic_exchange_n(&p->started, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_t t;
+
+		pthread_create(&t, NULL, task_worker, p);
+		pthread_detach(t);
+	}
+}
+
+/*
+  Chunks are kept in an array ordered by their start offset within the
+  concatenation, so the chunk holding an offset can be found by binary
+  search. Each handle's hint remembers the chunk its last read ended in,
+  which makes sequential reads O(1).
+
+  Zero and pattern chunks ("@zero len", "@pattern file len") have no fd,
+  their bytes are made up in memory. A pattern chunk keeps the pattern
+  file's contents in map, loaded on its first read.
+*/
+
+enum chunk_kind {
+	CHUNK_FILE,
+	CHUNK_ZERO,
+	CHUNK_PATTERN,
+	CHUNK_ZSTD,
+	CHUNK_REMOTE,
+};
 
 struct chunk {
-	struct chunk * next;
+	struct chunk * pool_prev;
+	struct chunk * pool_next;
+	const char * path;
+	int kind;
+
+	int fd;
+	int users;
+	int referenced;
+	off_t start;
+	off_t fsize;
+
+	/* where the chunk starts in its file, slices never grow */
+	off_t offset;
+	int slice;
+
+	/*
+	  with -o mmap: 0 until mapped, MAP_FAILED if it can't be; the
+	  pattern of pattern chunks, the frame index of zstd chunks and the
+	  object of remote chunks
+	*/
+	void * map;
+	off_t map_len;
+
+	/* the file's identity for the block cache, set once ident is */
+	int ident;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
+/*
+  A concat_file holds the chunks of one manifest version and is shared
+  by all handles opened on it; refcount counts those handles and the
+  chunk pins deferred by read_buf.
+
+  Each open gets its own concat_handle, which is handed to FUSE as the
+  file handle (fi->fh), so reads don't need any lookup or global lock.
+*/
+
+struct concat_file {
+	struct manifest * m;
+	struct chunk * chunks;
+	size_t nchunks;
+
+	off_t fsize;
+	int refcount;
+
+	uint64_t created;
+	uint64_t bytes_read;
+};
+
+struct concat_handle {
+	struct concat_file * cf;
+	size_t hint;
+
+	off_t next_offset;
+	off_t prefetched;
+	unsigned int sequential;
+
+	int fd;
+
+	/* the chunk fd writes go to, and the versions a new chunk replaced */
+	pthread_mutex_t write_lock;
+	int wfd;
+	size_t wchunk;
+	struct concat_file ** retired;
+	size_t nretired;
+};
+
+/* appends grow the last chunk under readers, so sizes are read atomically */
+static off_t chunk_size(struct chunk * c)
+{
+	return __atomic_load_n(&c->fsize, __ATOMIC_RELAXED);
+}
+
+static off_t concat_size(struct concat_file * cf)
+{
+	return __atomic_load_n(&cf->fsize, __ATOMIC_RELAXED);
+}
+
+static struct concat_file * handle_file(struct concat_handle * h)
+{
+	return __atomic_load_n(&h->cf, __ATOMIC_ACQUIRE);
+}
+
+/*
+  Parsed manifests are cached by source path, so getattr and open don't
+  have to re-read the manifest and stat every chunk each time.
+
+  An entry is dropped as soon as the manifest's inode, size, mtime or
+  ctime changes. The chunks themselves are re-stat'ed at most every
+  chunk_ttl seconds.
+
+  As long as an entry stays valid, the concatenation's contents can't
+  have changed, so reopening it keeps the kernel's page cache.
+*/
+
+struct manifest_chunk {
+	char * path;
+	off_t fsize;
+	struct timespec mtime;
+
+	/* set for "path offset length" entries */
+	off_t offset;
+	int slice;
+	int kind;
+
+	/* the file's size, fsize is the decompressed one for zstd chunks */
+	off_t csize;
+};
+
+struct manifest {
+	struct manifest * next;
+	struct manifest_chunk * chunks;
+	size_t nchunks;
+	struct concat_file * cf;
+
+	char * path;
+	dev_t dev;
+	ino_t ino;
+	off_t msize;
+	struct timespec mtime;
+	struct timespec ctime;
+
+	off_t fsize;
+	struct timespec newest;
+	time_t validated;
+	int opened;
+
+	/* set while it's the cache's entry for its path */
+	int cached;
+
+	/* with -o watch: 1 once watched, 2 once re-stat'ed after that */
+	int watched;
+	int refcount;
+
+	/* nested manifests the chunks were flattened from */
+	struct manifest_chunk * deps;
+	size_t ndeps;
+
+	/* compiled manifest the chunk paths point into, if any */
+	void * map;
+	size_t map_len;
+
+	/* the joined paths of a compiled manifest not in the root */
+	char * strings;
+};
+
+#define MANIFEST_HASH_SIZE 1024
+
+static struct manifest * manifests[MANIFEST_HASH_SIZE];
+static pthread_mutex_t manifest_lock;
+
+static time_t now_seconds()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static int timespec_equal(const struct timespec * a, const struct timespec * b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static int timespec_cmp(const struct timespec * a, const struct timespec * b)
+{
+	if (a->tv_sec != b->tv_sec) {
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	}
+	if (a->tv_nsec != b->tv_nsec) {
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	}
+	return 0;
+}
+
+static unsigned int hash_path(const char * path)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *path; path++) {
+		h = (h ^ (unsigned char) *path) * 16777619u;
+	}
+
+	return h % MANIFEST_HASH_SIZE;
+}
+
+static int manifest_matches(struct manifest * m, const struct stat * st)
+{
+	return m->dev == st->st_dev
+		&& m->ino == st->st_ino
+		&& m->msize == st->st_size
+		&& timespec_equal(&m->mtime, &st->st_mtim)
+		&& timespec_equal(&m->ctime, &st->st_ctim);
+}
+
+static void manifest_free(struct manifest * m)
+{
+	size_t i;
+
+	if (m->map) {
+		munmap(m->map, m->map_len);
+	}
+
+	if (m->map || m->strings) {
+		free(m->strings);
+	} else {
+		for (i = 0; i < m->nchunks; i++) {
+			free(m->chunks[i].path);
+		}
+		for (i = 0; i < m->ndeps; i++) {
+			free(m->deps[i].path);
+		}
+	}
+
+	free(m->chunks);
+	free(m->deps);
+	free(m->path);
+	free(m);
+}
+
+/* drops one reference, called with manifest_lock held */
+static void manifest_unref(struct manifest * m)
+{
+	if (--m->refcount == 0) {
+		manifest_free(m);
+	}
+}
+
+static void manifest_put(struct manifest * m)
+{
+	if (!m) {
+		return;
+	}
+
+	pthread_mutex_lock(&manifest_lock);
+	manifest_unref(m);
+	pthread_mutex_unlock(&manifest_lock);
+}
+
+/*
+  Manifest entries are stat'ed concurrently on the task pool, so on
+  network file systems resolving a manifest costs about one round trip
+  per io_threads entries instead of one per entry.
+*/
+
+/*
+  Manifest lines starting with http://, https:// or s3:// reference
+  remote objects when concatfs is built with -DHAVE_CURL. s3://bucket/key
+  is fetched from s3_endpoint/bucket/key without request signing, so the
+  bucket has to allow anonymous reads. An object's size and mtime come
+  from a HEAD request and are kept for remote_ttl seconds, its bytes from
+  range GETs. Idle curl handles go back to a pool and keep their
+  connection open, so most requests don't pay for a handshake. Reads
+  over REMOTE_PART are split into range GETs running in parallel on the
+  task pool.
+
+  With -o remote_cache=DIR, every object version has a sparse file there
+  that fills up with the REMOTE_PART blocks fetched; holes are the blocks
+  that haven't been.
+*/
+
+#define REMOTE_PART (1 << 20)
+#define REMOTE_HASH 1024
+
+struct remote {
+	struct remote * next;
+	char * path;
+	char * url;
+
+	/* the last HEAD's result, rv is 0 or an errno */
+	int rv;
+	off_t size;
+	struct timespec mtime;
+	time_t checked;
+
+	/* the cache file of version, which counts size and mtime changes */
+	pthread_rwlock_t cache_lock;
+	unsigned int version;
+	int cache_fd;
+};
+
+static struct remote * remotes[REMOTE_HASH];
+static pthread_mutex_t remote_lock;
+static int remote_cache_dir = -1;
+
+static int is_remote_path(const char * path)
+{
+#ifdef HAVE_CURL
+	return strncmp(path, "http://", 7) == 0
+		|| strncmp(path, "https://", 8) == 0
+		|| strncmp(path, "s3://", 5) == 0;
+#else
+	return 0;
+#endif
+}
+
+static uint64_t remote_hash(const char * path)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *path; path++) {
+		h = (h ^ (unsigned char) *path) * 1099511628211ULL;
+	}
+
+	return h;
+}
+
+static struct remote * remote_lookup(const char * path)
+{
+	struct remote ** p = &remotes[remote_hash(path) % REMOTE_HASH];
+	struct remote * r;
+
+	pthread_mutex_lock(&remote_lock);
+
+	for (r = *p; r && strcmp(r->path, path) != 0; r = r->next) {
+	}
+
+	if (!r) {
+		r = (struct remote *) calloc(sizeof(struct remote), 1);
+
+		r->path = strdup(path);
+		r->cache_fd = -1;
+		pthread_rwlock_init(&r->cache_lock, NULL);
+
+		if (strncmp(path, "s3://", 5) == 0) {
+			size_t len = strlen(options.s3_endpoint)
+				+ strlen(path + 5) + 2;
+
+			r->url = (char *) malloc(len);
+			snprintf(r->url, len, "%s/%s",
+				 options.s3_endpoint, path + 5);
+		} else {
+			r->url = strdup(path);
+		}
+
+		r->next = *p;
+		*p = r;
+	}
+
+	pthread_mutex_unlock(&remote_lock);
+
+	return r;
+}
+
+#ifdef HAVE_CURL
+static CURL ** remote_idle;
+static size_t remote_nidle = 0;
+
+static CURL * remote_handle_get()
+{
+	CURL * h = 0;
+
+	pthread_mutex_lock(&remote_lock);
+
+	if (remote_nidle > 0) {
+		h = remote_idle[--remote_nidle];
+	}
+
+	pthread_mutex_unlock(&remote_lock);
+
+	/* a reset handle keeps its connections */
+	if (h) {
+		curl_easy_reset(h);
+	} else if (!(h = curl_easy_init())) {
+		return 0;
+	}
+
+	curl_easy_setopt(h, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(h, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(h, CURLOPT_TCP_KEEPALIVE, 1L);
+
+	return h;
+}
+
+static void remote_handle_put(CURL * h)
+{
+	pthread_mutex_lock(&remote_lock);
+
+	if (remote_nidle < options.remote_conns) {
+		remote_idle[remote_nidle++] = h;
+		h = 0;
+	}
+
+	pthread_mutex_unlock(&remote_lock);
+
+	if (h) {
+		curl_easy_cleanup(h);
+	}
+}
+
+static int remote_errno(CURLcode rc, long code)
+{
+	if (rc != CURLE_OK) {
+		return EIO;
+	}
+	if (code == 404 || code == 410) {
+		return ENOENT;
+	}
+	if (code == 401 || code == 403) {
+		return EACCES;
+	}
+
+	return code / 100 == 2 ? 0 : EIO;
+}
+
+static int remote_head(struct remote * r, off_t * size,
+		       struct timespec * mtime)
+{
+	CURL * h = remote_handle_get();
+	curl_off_t len = -1;
+	long filetime = -1;
+	long code = 0;
+	CURLcode rc;
+
+	if (!h) {
+		return ENOMEM;
+	}
+
+	curl_easy_setopt(h, CURLOPT_URL, r->url);
+	curl_easy_setopt(h, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(h, CURLOPT_FILETIME, 1L);
+
+	if ((rc = curl_easy_perform(h)) == CURLE_OK) {
+		curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &code);
+		curl_easy_getinfo(h, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+		curl_easy_getinfo(h, CURLINFO_FILETIME, &filetime);
+	}
+
+	remote_handle_put(h);
+
+	if (remote_errno(rc, code)) {
+		return remote_errno(rc, code);
+	}
+	if (len < 0) {
+		return EIO;
+	}
+
+	*size = len;
+	mtime->tv_sec = filetime > 0 ? filetime : 0;
+	mtime->tv_nsec = 0;
+
+	return 0;
+}
+
+struct remote_sink {
+	char * buf;
+	size_t len;
+	size_t got;
+};
+
+/* stops the transfer once the buffer is full */
+static size_t remote_sink_write(char * p, size_t size, size_t nmemb,
+				void * arg)
+{
+	struct remote_sink * s = (struct remote_sink *) arg;
+	size_t n = size * nmemb;
+
+	if (n > s->len - s->got) {
+		n = s->len - s->got;
+	}
+
+	memcpy(s->buf + s->got, p, n);
+	s->got += n;
+
+	return n;
+}
+#else
+static int remote_head(struct remote * r, off_t * size,
+		       struct timespec * mtime)
+{
+	return ENOSYS;
+}
+#endif
+
+/* range GET of len bytes at offset, returns the bytes read or -errno */
+static ssize_t remote_fetch(struct remote * r, char * buf, size_t len,
+			    off_t offset)
+{
+#ifdef HAVE_CURL
+	struct remote_sink s = { buf, len, 0 };
+	CURL * h = remote_handle_get();
+	char range[64];
+	uint64_t start;
+	long code = 0;
+	CURLcode rc;
+
+	if (!h) {
+		return -ENOMEM;
+	}
+
+	snprintf(range, sizeof(range), "%lld-%lld", (long long) offset,
+		 (long long) (offset + len - 1));
+
+	curl_easy_setopt(h, CURLOPT_URL, r->url);
+	curl_easy_setopt(h, CURLOPT_RANGE, range);
+	curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, remote_sink_write);
+	curl_easy_setopt(h, CURLOPT_WRITEDATA, &s);
+
+	start = now_ns();
+	rc = curl_easy_perform(h);
+	curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &code);
+
+	remote_handle_put(h);
+
+	if (rc == CURLE_WRITE_ERROR && s.got == len) {
+		rc = CURLE_OK;
+	}
+
+	/* a server ignoring the range only helps for reads from the start */
+	if (remote_errno(rc, code) || (code != 206 && offset != 0)) {
+		return remote_errno(rc, code) ? -remote_errno(rc, code) : -EIO;
+	}
+
+	stats_count(STAT_REMOTE_GET, start);
+	stat_add(&thread_stats_get()->remote_bytes, s.got);
+
+	return s.got;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/* fstatat for remote objects, HEADs at most every remote_ttl seconds */
+static int remote_stat(const char * path, struct stat * st)
+{
+	struct remote * r = remote_lookup(path);
+	time_t now = now_seconds();
+	struct timespec mtime;
+	off_t size = 0;
+	int stale;
+	int rv;
+
+	pthread_mutex_lock(&remote_lock);
+	stale = !r->checked || now - r->checked >= options.remote_ttl;
+	pthread_mutex_unlock(&remote_lock);
+
+	if (stale) {
+		rv = remote_head(r, &size, &mtime);
+
+		pthread_rwlock_wrlock(&r->cache_lock);
+		pthread_mutex_lock(&remote_lock);
+
+		if (rv == 0 && (size != r->size
+				|| !timespec_equal(&mtime, &r->mtime))) {
+			if (r->cache_fd >= 0) {
+				close(r->cache_fd);
+				r->cache_fd = -1;
+			}
+			r->version++;
+			r->size = size;
+			r->mtime = mtime;
+		}
+		r->rv = rv;
+		r->checked = now;
+
+		pthread_mutex_unlock(&remote_lock);
+		pthread_rwlock_unlock(&r->cache_lock);
+	}
+
+	memset(st, 0, sizeof(*st));
+
+	pthread_mutex_lock(&remote_lock);
+
+	rv = r->rv;
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_ino = remote_hash(path);
+	st->st_size = r->size;
+	st->st_mtim = r->mtime;
+	st->st_blksize = REMOTE_PART;
+
+	pthread_mutex_unlock(&remote_lock);
+
+	if (rv) {
+		errno = rv;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* fstatat for chunk paths, local or remote */
+static int chunk_stat(const char * path, struct stat * st)
+{
+	if (is_remote_path(path)) {
+		return remote_stat(path, st);
+	}
+
+	return fstatat(src_fd, path, st, 0);
+}
+
+/*
+  opens the cache file of r's current version, with cache_lock held for
+  reading; -1 without remote_cache
+*/
+static int remote_cache_fd(struct remote * r)
+{
+	char name[64];
+	int fd;
+
+	if (remote_cache_dir < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&remote_lock);
+
+	if ((fd = r->cache_fd) < 0) {
+		snprintf(name, sizeof(name), "%016llx-%llx-%llx",
+			 (unsigned long long) remote_hash(r->path),
+			 (unsigned long long) r->size,
+			 (unsigned long long) r->mtime.tv_sec);
+
+		fd = openat(remote_cache_dir, name,
+			    O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+		if (fd >= 0 && ftruncate(fd, r->size) != 0) {
+			close(fd);
+			fd = -1;
+		}
+
+		r->cache_fd = fd;
+	}
+
+	pthread_mutex_unlock(&remote_lock);
+
+	return fd;
+}
+
+/* the cache file has to report holes for blocks not fetched yet */
+static int remote_cache_open(const char * dir)
+{
+	int fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	char name[64];
+	int probe;
+	int ok;
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	snprintf(name, sizeof(name), ".concatfs-probe-%d", (int) getpid());
+
+	if ((probe = openat(fd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			    0600)) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	ok = ftruncate(probe, REMOTE_PART) == 0
+		&& lseek(probe, 0, SEEK_DATA) < 0 && errno == ENXIO;
+
+	close(probe);
+	unlinkat(fd, name, 0);
+
+	if (!ok) {
+		close(fd);
+		return -EOPNOTSUPP;
+	}
+
+	remote_cache_dir = fd;
+
+	return 0;
+}
+
+struct path_stat {
+	struct task task;
+	char * path;
+	struct stat st;
+	int rv;
+};
+
+static void path_stat_run(struct task * t)
+{
+	struct path_stat * s = (struct path_stat *) t;
+
+	/* entries without a file */
+	if (!s->path) {
+		s->rv = -1;
+		return;
+	}
+
+	s->rv = chunk_stat(s->path, &s->st);
+}
+
+static void stat_paths(struct path_stat * s, size_t n)
+{
+	struct task_group g;
+	size_t i;
+
+	if (n == 0) {
+		return;
+	}
+
+	task_group_init(&g, &io_pool);
+
+	for (i = 1; i < n; i++) {
+		s[i].task.fn = path_stat_run;
+		task_submit(&g, &s[i].task);
+	}
+
+	path_stat_run(&s[0].task);
+
+	task_group_wait(&g);
+	task_group_destroy(&g);
+}
+
+#define CFIDX_SUFFIX ".cfidx"
+
+static int is_cfidx_file(const char * path)
+{
+	size_t len = strlen(path);
+
+	return len >= sizeof(CFIDX_SUFFIX) - 1
+		&& strcmp(path + len - (sizeof(CFIDX_SUFFIX) - 1),
+			  CFIDX_SUFFIX) == 0;
+}
+
+static int is_concatfs_file(const char * path)
+{
+	char fpath[PATH_MAX];
+
+	strncpy(fpath, path, sizeof(fpath));
+
+	return (strstr(basename(fpath), "-concat-") != 0
+		&& !is_cfidx_file(path));
+}
+
+/*
+  Entries that are manifests themselves are flattened into the parent's
+  chunk list, so reading a nested concat costs the same as reading a flat
+  one. The nested manifests are kept as dependencies and re-checked along
+  with the chunks. frame links the manifests currently being parsed, an
+  entry that is one of them is a cycle and gets skipped.
+*/
+
+#define MANIFEST_MAX_DEPTH 32
+
+struct manifest_frame {
+	dev_t dev;
+	ino_t ino;
+	int depth;
+	struct manifest_frame * up;
+};
+
+static int manifest_on_stack(const struct manifest_frame * f,
+			     const struct stat * st)
+{
+	for (; f; f = f->up) {
+		if (f->dev == st->st_dev && f->ino == st->st_ino) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void manifest_add_dep(struct manifest * m, char * path,
+			     off_t size, const struct timespec * mtime)
+{
+	struct manifest_chunk * d;
+
+	if ((m->ndeps & (m->ndeps - 1)) == 0) {
+		m->deps = (struct manifest_chunk *) realloc(
+			m->deps, (m->ndeps ? m->ndeps * 2 : 1)
+			* sizeof(struct manifest_chunk));
+	}
+
+	d = &m->deps[m->ndeps++];
+
+	d->path = path;
+	d->fsize = size;
+	d->mtime = *mtime;
+	d->offset = 0;
+	d->slice = 0;
+	d->kind = CHUNK_FILE;
+	d->csize = size;
+}
+
+/*
+  Returns the length of line[0..len) without a trailing, blank separated
+  number, which goes to v. Returns len if there is none.
+*/
+
+static size_t manifest_strip_number(const char * line, size_t len, off_t * v)
+{
+	size_t e = len;
+	size_t d;
+
+	while (e > 0 && isblank((unsigned char) line[e - 1])) {
+		e--;
+	}
+
+	for (d = e; d > 0 && isdigit((unsigned char) line[d - 1]); d--) {
+	}
+
+	if (d == e || d == 0 || !isblank((unsigned char) line[d - 1])) {
+		return len;
+	}
+
+	*v = strtoll(line + d, 0, 10);
+
+	while (d > 0 && isblank((unsigned char) line[d - 1])) {
+		d--;
+	}
+
+	return d;
+}
+
+/*
+  "path offset length" lines reference a slice of path. If the trailing
+  numbers are there, they are cut off, leaving the path in line.
+*/
+
+static int manifest_parse_range(char * line, off_t * offset, off_t * length)
+{
+	size_t len = strlen(line);
+	size_t n1 = manifest_strip_number(line, len, length);
+	size_t n2;
+
+	if (n1 == len) {
+		return 0;
+	}
+
+	n2 = manifest_strip_number(line, n1, offset);
+
+	if (n2 == n1 || n2 == 0) {
+		return 0;
+	}
+
+	line[n2] = 0;
+
+	return 1;
+}
+
+/*
+  "@zero length" and "@pattern file length" lines, returns the chunk kind
+  and, for patterns, the file name in *file
+*/
+
+static int manifest_parse_special(char * line, off_t * length, char ** file)
+{
+	size_t len = strlen(line);
+	size_t n;
+
+	if (line[0] != '@') {
+		return CHUNK_FILE;
+	}
+
+	n = manifest_strip_number(line, len, length);
+
+	if (n == len) {
+		return CHUNK_FILE;
+	}
+
+	if (n == 5 && strncmp(line, "@zero", 5) == 0) {
+		return CHUNK_ZERO;
+	}
+
+	if (n > 9 && strncmp(line, "@pattern", 8) == 0
+	    && isblank((unsigned char) line[8])) {
+		line[n] = 0;
+		for (*file = line + 8; isblank((unsigned char) **file); (*file)++) {
+		}
+		return CHUNK_PATTERN;
+	}
+
+	return CHUNK_FILE;
+}
+
+static char * manifest_resolve(const char * base_dir, const char * entry)
+{
+	char tpath[PATH_MAX];
+
+	if (is_remote_path(entry)) {
+		return strdup(entry);
+	}
+
+	if (entry[0] == '/' || strcmp(base_dir, ".") == 0) {
+		strncpy(tpath, entry, sizeof(tpath));
+		tpath[PATH_MAX - 1] = 0;
+	} else {
+		snprintf(tpath, sizeof(tpath), "%s/%s", base_dir, entry);
+	}
+
+	return strdup(tpath);
+}
+
+/*
+  Chunks in the seekable zstd format, as written by the zstd seekable
+  API or t2sz, are decompressed on the fly when concatfs is built with
+  -DHAVE_ZSTD. The format ends in a skippable frame listing the
+  compressed and decompressed size of every frame, so the frame holding
+  any offset is found without decompressing anything in front of it.
+  Only files named *.zst are checked for that seek table.
+*/
+
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5Eu
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1u
+#define ZSTD_SEEK_FOOTER 9
+#define ZSTD_MAX_FRAME (64 << 20)
+
+struct zstd_index {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+
+	/* nframes + 1 offsets of the frames in the file and in the data */
+	uint32_t nframes;
+	uint64_t * coff;
+	uint64_t * doff;
+};
+
+static int is_zstd_file(const char * path)
+{
+#ifdef HAVE_ZSTD
+	size_t len = strlen(path);
+
+	return len > 4 && strcmp(path + len - 4, ".zst") == 0;
+#else
+	return 0;
+#endif
+}
+
+static uint32_t read_le32(const unsigned char * p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void zstd_index_free(struct zstd_index * zi)
+{
+	if (zi) {
+		free(zi->coff);
+		free(zi->doff);
+		free(zi);
+	}
+}
+
+/* reads the seek table of fd, 0 if it isn't a seekable zstd file */
+static struct zstd_index * zstd_index_read(int fd)
+{
+	unsigned char foot[ZSTD_SEEK_FOOTER];
+	unsigned char * table;
+	struct zstd_index * zi;
+	struct stat st;
+	size_t esize;
+	size_t tlen;
+	off_t tpos;
+	uint32_t i;
+	int ok;
+
+	if (fstat(fd, &st) != 0 || st.st_size < 8 + ZSTD_SEEK_FOOTER
+	    || pread(fd, foot, sizeof(foot), st.st_size - sizeof(foot))
+	    != sizeof(foot)
+	    || read_le32(foot + 5) != ZSTD_SEEKABLE_MAGIC
+	    || (foot[4] & 0x7c) != 0) {
+		return 0;
+	}
+
+	zi = (struct zstd_index *) calloc(sizeof(struct zstd_index), 1);
+
+	zi->nframes = read_le32(foot);
+	esize = (foot[4] & 0x80) ? 12 : 8;
+
+	if ((off_t) zi->nframes * esize > st.st_size - 8 - ZSTD_SEEK_FOOTER) {
+		free(zi);
+		return 0;
+	}
+
+	tlen = 8 + zi->nframes * esize;
+	tpos = st.st_size - ZSTD_SEEK_FOOTER - tlen;
+	table = (unsigned char *) malloc(tlen);
+
+	zi->coff = (uint64_t *) calloc(sizeof(uint64_t), zi->nframes + 1);
+	zi->doff = (uint64_t *) calloc(sizeof(uint64_t), zi->nframes + 1);
+
+	ok = pread(fd, table, tlen, tpos) == (ssize_t) tlen
+		&& read_le32(table) == ZSTD_SKIPPABLE_MAGIC
+		&& read_le32(table + 4) == tlen - 8 + ZSTD_SEEK_FOOTER;
+
+	for (i = 0; ok && i < zi->nframes; i++) {
+		const unsigned char * e = table + 8 + i * esize;
+		uint32_t dlen = read_le32(e + 4);
+
+		zi->coff[i + 1] = zi->coff[i] + read_le32(e);
+		zi->doff[i + 1] = zi->doff[i] + dlen;
+
+		ok = dlen <= ZSTD_MAX_FRAME;
+	}
+
+	free(table);
+
+	/* the frames have to cover everything in front of the seek table */
+	if (!ok || zi->coff[zi->nframes] != (uint64_t) tpos) {
+		zstd_index_free(zi);
+		return 0;
+	}
+
+	zi->dev = st.st_dev;
+	zi->ino = st.st_ino;
+	zi->size = st.st_size;
+	zi->mtime = st.st_mtim;
+
+	return zi;
+}
+
+/* the decompressed size of a seekable zstd chunk, -1 if it isn't one */
+static off_t zstd_file_size(const char * path)
+{
+	struct zstd_index * zi;
+	off_t rv = -1;
+	int fd = openat(src_fd, path, O_RDONLY);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if ((zi = zstd_index_read(fd))) {
+		rv = zi->doff[zi->nframes];
+		zstd_index_free(zi);
+	}
+
+	close(fd);
+
+	return rv;
+}
+
+/* a range is clamped to the data that is there, length -1 is all of it */
+struct manifest_range {
+	int kind;
+	off_t offset;
+	off_t length;
+
+	/* the unsplit line, in case that is the file's name */
+	char * line;
+};
+
+static void range_clamp(struct manifest_range * r, off_t size)
+{
+	if (r->length < 0) {
+		r->offset = 0;
+		r->length = size;
+		return;
+	}
+
+	if (r->offset > size) {
+		r->offset = size;
+	}
+	if (r->length > size - r->offset) {
+		r->length = size - r->offset;
+	}
+}
+
+static struct manifest * manifest_parse_nested(
+	const char * path, const struct stat * st,
+	struct manifest_frame * up)
+{
+	struct manifest * rv;
+	struct manifest_frame frame;
+	struct path_stat * entries = 0;
+	struct manifest_range * ranges = 0;
+	size_t nentries = 0;
+	size_t alloced = 0;
+	size_t nalloced;
+	char bpath[PATH_MAX+1];
+	char fpath[PATH_MAX+1];
+	char * base_dir;
+	size_t i, j;
+
+	FILE * fp;
+	int fd = openat(src_fd, path, O_RDONLY);
+
+	if (fd < 0) {
+		return 0;
+	}
+
+	fp = fdopen(fd, "r");
+
+	if (!fp) {
+		close(fd);
+		return 0;
+	}
+
+	rv = (struct manifest *) calloc(sizeof(struct manifest), 1);
+	strncpy(bpath, path, sizeof(bpath));
+
+	bpath[PATH_MAX] = 0;
+	fpath[PATH_MAX] = 0;
+
+	base_dir = dirname(bpath);
+
+	rv->path = strdup(path);
+	rv->dev = st->st_dev;
+	rv->ino = st->st_ino;
+	rv->msize = st->st_size;
+	rv->mtime = st->st_mtim;
+	rv->ctime = st->st_ctim;
+	rv->newest = st->st_mtim;
+	rv->validated = now_seconds();
+	rv->refcount = 1;
+
+	frame.dev = st->st_dev;
+	frame.ino = st->st_ino;
+	frame.depth = up ? up->depth + 1 : 0;
+	frame.up = up;
+
+	while (fgets(fpath, sizeof(fpath), fp)) {
+		struct manifest_range * r;
+		char * full;
+
+		fpath[strcspn(fpath, "\n")] = 0;
+
+		if (!fpath[0]) {
+			continue;
+		}
+
+		if (nentries == alloced) {
+			alloced = alloced ? alloced * 2 : 16;
+			entries = (struct path_stat *) realloc(
+				entries, alloced * sizeof(struct path_stat));
+			ranges = (struct manifest_range *) realloc(
+				ranges, alloced * sizeof(struct manifest_range));
+		}
+
+		r = &ranges[nentries];
+		r->kind = manifest_parse_special(fpath, &r->length, &full);
+		r->offset = 0;
+		r->line = 0;
+
+		if (r->kind == CHUNK_ZERO) {
+			entries[nentries++].path = 0;
+			continue;
+		}
+		if (r->kind == CHUNK_PATTERN) {
+			entries[nentries++].path = manifest_resolve(base_dir, full);
+			continue;
+		}
+
+		full = manifest_resolve(base_dir, fpath);
+
+		if (manifest_parse_range(fpath, &r->offset, &r->length)) {
+			r->line = full;
+			full = manifest_resolve(base_dir, fpath);
+		} else {
+			r->length = -1;
+		}
+
+		entries[nentries++].path = full;
+	}
+	fclose(fp);
+
+	stat_paths(entries, nentries);
+
+	/* a file whose name merely ends in two numbers */
+	for (i = 0; i < nentries; i++) {
+		struct path_stat * e = &entries[i];
+		struct manifest_range * r = &ranges[i];
+
+		if (!r->line) {
+			continue;
+		}
+
+		if (e->rv != 0 && chunk_stat(r->line, &e->st) == 0) {
+			free(e->path);
+			e->path = r->line;
+			e->rv = 0;
+			r->length = -1;
+		} else {
+			free(r->line);
+		}
+
+		r->line = 0;
+	}
+
+	nalloced = nentries ? nentries : 1;
+	rv->chunks = (struct manifest_chunk *) calloc(
+		sizeof(struct manifest_chunk), nalloced);
+
+	for (i = 0; i < nentries; i++) {
+		struct path_stat * e = &entries[i];
+		struct manifest_range * r = &ranges[i];
+		struct manifest_chunk * c;
+		struct manifest * sub;
+		int slice = r->length >= 0;
+		off_t sub_start;
+
+		if (r->kind == CHUNK_ZERO) {
+			c = &rv->chunks[rv->nchunks++];
+
+			c->path = strdup("@zero");
+			c->fsize = r->length;
+			c->mtime = st->st_mtim;
+			c->offset = 0;
+			c->slice = 1;
+			c->kind = CHUNK_ZERO;
+			c->csize = 0;
+
+			rv->fsize += c->fsize;
+			continue;
+		}
+
+		if (e->rv != 0 || !S_ISREG(e->st.st_mode)
+		    || (r->kind == CHUNK_PATTERN
+			&& (e->st.st_size == 0 || is_remote_path(e->path)))) {
+			free(e->path);
+			continue;
+		}
+
+		if (r->kind == CHUNK_PATTERN) {
+			c = &rv->chunks[rv->nchunks++];
+
+			c->path = e->path;
+			c->fsize = r->length;
+			c->mtime = e->st.st_mtim;
+			c->offset = 0;
+			c->slice = 1;
+			c->kind = CHUNK_PATTERN;
+			c->csize = e->st.st_size;
+
+			rv->fsize += c->fsize;
+
+			if (timespec_cmp(&c->mtime, &rv->newest) > 0) {
+				rv->newest = c->mtime;
+			}
+			continue;
+		}
+
+		if (!is_concatfs_file(e->path) || is_remote_path(e->path)) {
+			int remote = is_remote_path(e->path);
+			off_t dsize = !remote && is_zstd_file(e->path)
+				? zstd_file_size(e->path) : -1;
+
+			c = &rv->chunks[rv->nchunks++];
+
+			range_clamp(r, dsize >= 0 ? dsize : e->st.st_size);
+
+			c->path = e->path;
+			c->fsize = r->length;
+			c->mtime = e->st.st_mtim;
+			c->offset = r->offset;
+			c->slice = slice;
+			c->kind = remote ? CHUNK_REMOTE
+				: dsize >= 0 ? CHUNK_ZSTD : CHUNK_FILE;
+			c->csize = e->st.st_size;
+
+			rv->fsize += c->fsize;
+
+			if (timespec_cmp(&c->mtime, &rv->newest) > 0) {
+				rv->newest = c->mtime;
+			}
+			continue;
+		}
+
+		sub = 0;
+
+		if (frame.depth < MANIFEST_MAX_DEPTH
+		    && !manifest_on_stack(&frame, &e->st)) {
+			sub = manifest_parse_nested(e->path, &e->st, &frame);
+		}
+
+		if (!sub) {
+			free(e->path);
+			continue;
+		}
+
+		if (rv->nchunks + sub->nchunks + (nentries - i) > nalloced) {
+			nalloced = rv->nchunks + sub->nchunks + (nentries - i);
+			rv->chunks = (struct manifest_chunk *) realloc(
+				rv->chunks,
+				nalloced * sizeof(struct manifest_chunk));
+		}
+
+		/* a slice of a nested manifest cuts its chunk list */
+		range_clamp(r, sub->fsize);
+		sub_start = 0;
+
+		for (j = 0; j < sub->nchunks; j++) {
+			struct manifest_chunk * sc = &sub->chunks[j];
+			off_t from = r->offset - sub_start;
+			off_t to = r->offset + r->length - sub_start;
+
+			sub_start += sc->fsize;
+
+			if (from < 0) {
+				from = 0;
+			}
+			if (to > sc->fsize) {
+				to = sc->fsize;
+			}
+
+			if (from >= to && !(sc->fsize == 0 && !slice)) {
+				free(sc->path);
+				continue;
+			}
+
+			c = &rv->chunks[rv->nchunks++];
+			*c = *sc;
+
+			if (from > 0 || to < sc->fsize) {
+				c->offset += from;
+				c->fsize = to - from;
+				c->slice = 1;
+			}
+		}
+
+		rv->fsize += r->length;
+
+		manifest_add_dep(rv, e->path, e->st.st_size, &e->st.st_mtim);
+
+		for (j = 0; j < sub->ndeps; j++) {
+			manifest_add_dep(rv, sub->deps[j].path,
+					 sub->deps[j].fsize,
+					 &sub->deps[j].mtime);
+		}
+
+		if (timespec_cmp(&sub->newest, &rv->newest) > 0) {
+			rv->newest = sub->newest;
+		}
+
+		/* the paths moved over to rv */
+		free(sub->chunks);
+		free(sub->deps);
+		free(sub->path);
+		free(sub);
+	}
+
+	free(entries);
+	free(ranges);
+	return rv;
+}
+
+static struct manifest * manifest_parse(const char * path,
+					const struct stat * st)
+{
+	return manifest_parse_nested(path, st, 0);
+}
+
+/*
+  A manifest can be compiled into a sidecar file next to it (the
+  manifest's name plus ".cfidx") holding the resolved chunk paths, sizes,
+  mtimes and offsets in host byte order:
+
+    header, nchunks records, ndeps records of nested manifests,
+    string table of NUL terminated paths
+
+  It is mmap'ed and used as is. The header records the manifest's inode,
+  size and mtime, a sidecar that doesn't match them is ignored and the
+  text manifest is parsed instead.
+
+  Paths below the manifest's directory are stored relative to it and
+  joined with the directory the manifest is loaded from, so sidecars
+  stay valid when the source tree is renamed or moved.
+*/
+
+#define CFIDX_MAGIC "CFIDX\0\0\6"
+
+struct cfidx_header {
+	char magic[8];
+	uint64_t manifest_ino;
+	uint64_t manifest_size;
+	int64_t manifest_mtime_sec;
+	int64_t manifest_mtime_nsec;
+	uint64_t nchunks;
+	uint64_t strings_len;
+	uint64_t fsize;
+	uint64_t ndeps;
+};
+
+struct cfidx_chunk {
+	uint64_t path;
+	uint64_t fsize;
+	uint64_t start;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t offset;
+	uint64_t csize;
+	uint32_t slice;
+	uint32_t kind;
+};
+
+static int cfidx_matches(const struct cfidx_header * hdr,
+			 const struct stat * st)
+{
+	return memcmp(hdr->magic, CFIDX_MAGIC, sizeof(hdr->magic)) == 0
+		&& hdr->manifest_ino == (uint64_t) st->st_ino
+		&& hdr->manifest_size == (uint64_t) st->st_size
+		&& hdr->manifest_mtime_sec == (int64_t) st->st_mtim.tv_sec
+		&& hdr->manifest_mtime_nsec == (int64_t) st->st_mtim.tv_nsec;
+}
+
+/* frees a manifest whose paths point into a compiled manifest */
+static void cfidx_discard(struct manifest * m)
+{
+	free(m->strings);
+	free(m->chunks);
+	free(m->deps);
+	free(m->path);
+	free(m);
+}
+
+/* the chunks followed by the nested manifests */
+static struct manifest_chunk * index_rec(struct manifest * m, size_t i)
+{
+	return i < m->nchunks ? &m->chunks[i] : &m->deps[i - m->nchunks];
+}
+
+/* the length of the directory part of manifest path, with its slash */
+static size_t cfidx_dir_len(const char * path)
+{
+	const char * slash = strrchr(path, '/');
+
+	return slash ? (size_t) (slash - path) + 1 : 0;
+}
+
+/* whether a stored path is relative to the manifest's directory */
+static int cfidx_relative(const char * path)
+{
+	return path[0] != '/' && !is_remote_path(path);
+}
+
+/* prefixes the relative paths of m with its directory, into m->strings */
+static void cfidx_join_paths(struct manifest * m)
+{
+	size_t dlen = cfidx_dir_len(m->path);
+	size_t n = m->nchunks + m->ndeps;
+	size_t total = 0;
+	char * q;
+	size_t i;
+
+	if (!dlen) {
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct manifest_chunk * c = index_rec(m, i);
+
+		if (c->kind != CHUNK_ZERO && cfidx_relative(c->path)) {
+			total += dlen + strlen(c->path) + 1;
+		}
+	}
+
+	q = m->strings = (char *) malloc(total ? total : 1);
+
+	for (i = 0; i < n; i++) {
+		struct manifest_chunk * c = index_rec(m, i);
+		size_t len = strlen(c->path) + 1;
+
+		if (c->kind == CHUNK_ZERO || !cfidx_relative(c->path)) {
+			continue;
+		}
+
+		memcpy(q, m->path, dlen);
+		memcpy(q + dlen, c->path, len);
+		c->path = q;
+		q += dlen + len;
+	}
+}
+
+/*
+  returns the manifest compiled into p[0..len) if it matches st, its
+  paths point into p or m->strings
+*/
+static struct manifest * cfidx_decode(const void * p, size_t len,
+				      const char * path,
+				      const struct stat * st)
+{
+	const struct cfidx_header * hdr = (const struct cfidx_header *) p;
+	const struct cfidx_chunk * recs;
+	struct manifest * rv;
+	const char * strings;
+	uint64_t nrecs;
+	size_t i;
+
+	if (len < sizeof(*hdr)) {
+		return 0;
+	}
+
+	recs = (const struct cfidx_chunk *) (hdr + 1);
+	nrecs = hdr->nchunks + hdr->ndeps;
+
+	/* each term on its own first, so the sum can't wrap */
+	if (!cfidx_matches(hdr, st)
+	    || hdr->nchunks > len / sizeof(*recs)
+	    || hdr->ndeps > len / sizeof(*recs)
+	    || nrecs > (len - sizeof(*hdr)) / sizeof(*recs)
+	    || hdr->strings_len == 0
+	    || hdr->strings_len > len
+	    || sizeof(*hdr) + nrecs * sizeof(*recs) + hdr->strings_len
+	    != len) {
+		return 0;
+	}
+
+	strings = (const char *) (recs + nrecs);
+
+	if (strings[hdr->strings_len - 1] != 0) {
+		return 0;
+	}
+
+	rv = (struct manifest *) calloc(sizeof(struct manifest), 1);
+
+	rv->path = strdup(path);
+	rv->dev = st->st_dev;
+	rv->ino = st->st_ino;
+	rv->msize = st->st_size;
+	rv->mtime = st->st_mtim;
+	rv->ctime = st->st_ctim;
+	rv->newest = st->st_mtim;
+	rv->validated = now_seconds();
+	rv->refcount = 1;
+	rv->nchunks = hdr->nchunks;
+	rv->chunks = (struct manifest_chunk *) calloc(
+		sizeof(struct manifest_chunk), hdr->nchunks);
+	rv->ndeps = hdr->ndeps;
+	rv->deps = (struct manifest_chunk *) calloc(
+		sizeof(struct manifest_chunk), hdr->ndeps ? hdr->ndeps : 1);
+
+	for (i = 0; i < hdr->nchunks; i++) {
+		struct manifest_chunk * c = &rv->chunks[i];
+
+		if (recs[i].path >= hdr->strings_len
+		    || recs[i].start != (uint64_t) rv->fsize
+		    || recs[i].kind > CHUNK_REMOTE
+		    || (recs[i].kind == CHUNK_ZSTD
+			&& !is_zstd_file(strings + recs[i].path))
+		    || (recs[i].kind == CHUNK_REMOTE
+			&& !is_remote_path(strings + recs[i].path))) {
+			cfidx_discard(rv);
+			return 0;
+		}
+
+		c->path = (char *) strings + recs[i].path;
+		c->fsize = recs[i].fsize;
+		c->mtime.tv_sec = recs[i].mtime_sec;
+		c->mtime.tv_nsec = recs[i].mtime_nsec;
+		c->offset = recs[i].offset;
+		c->slice = recs[i].slice != 0;
+		c->kind = recs[i].kind;
+		c->csize = recs[i].csize;
+
+		rv->fsize += c->fsize;
+
+		if (timespec_cmp(&c->mtime, &rv->newest) > 0) {
+			rv->newest = c->mtime;
+		}
+	}
+
+	for (i = 0; i < hdr->ndeps; i++) {
+		const struct cfidx_chunk * r = &recs[hdr->nchunks + i];
+		struct manifest_chunk * d = &rv->deps[i];
+
+		if (r->path >= hdr->strings_len) {
+			cfidx_discard(rv);
+			return 0;
+		}
+
+		d->path = (char *) strings + r->path;
+		d->fsize = r->fsize;
+		d->mtime.tv_sec = r->mtime_sec;
+		d->mtime.tv_nsec = r->mtime_nsec;
+
+		if (timespec_cmp(&d->mtime, &rv->newest) > 0) {
+			rv->newest = d->mtime;
+		}
+	}
+
+	if ((uint64_t) rv->fsize != hdr->fsize) {
+		cfidx_discard(rv);
+		return 0;
+	}
+
+	cfidx_join_paths(rv);
+
+	return rv;
+}
+
+/* returns the manifest compiled for path, 0 if there is no usable one */
+static struct manifest * manifest_load_index(const char * path,
+					     const struct stat * st)
+{
+	struct manifest * rv;
+	char ipath[PATH_MAX];
+	struct stat stbuf;
+	void * map;
+	int fd;
+
+	snprintf(ipath, sizeof(ipath), "%s" CFIDX_SUFFIX, path);
+
+	fd = openat(src_fd, ipath, O_RDONLY);
+
+	if (fd < 0) {
+		return 0;
+	}
+
+	if (fstat(fd, &stbuf) != 0
+	    || stbuf.st_size < (off_t) sizeof(struct cfidx_header)) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(0, stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+
+	if (!(rv = cfidx_decode(map, stbuf.st_size, path, st))) {
+		munmap(map, stbuf.st_size);
+		return 0;
+	}
+
+	rv->map = map;
+	rv->map_len = stbuf.st_size;
+
+	return rv;
+}
+
+/* the path of record i as stored, relative to m's directory if below it */
+static const char * index_path(struct manifest * m, size_t i)
+{
+	const char * path = index_rec(m, i)->path;
+	size_t dlen = cfidx_dir_len(m->path);
+
+	if (dlen && strncmp(path, m->path, dlen) == 0
+	    && cfidx_relative(path + dlen)) {
+		return path + dlen;
+	}
+
+	return path;
+}
+
+/* the size of m compiled */
+static size_t cfidx_size(struct manifest * m)
+{
+	size_t n = m->nchunks + m->ndeps;
+	size_t strings_len = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		strings_len += strlen(index_path(m, i)) + 1;
+	}
+
+	return sizeof(struct cfidx_header) + n * sizeof(struct cfidx_chunk)
+		+ (strings_len ? strings_len : 1);
+}
+
+/* writes m compiled to fp */
+static void cfidx_encode(struct manifest * m, FILE * fp)
+{
+	size_t n = m->nchunks + m->ndeps;
+	struct cfidx_header hdr;
+	uint64_t start = 0;
+	uint64_t off = 0;
+	size_t i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CFIDX_MAGIC, sizeof(hdr.magic));
+	hdr.manifest_ino = m->ino;
+	hdr.manifest_size = m->msize;
+	hdr.manifest_mtime_sec = m->mtime.tv_sec;
+	hdr.manifest_mtime_nsec = m->mtime.tv_nsec;
+	hdr.nchunks = m->nchunks;
+	hdr.ndeps = m->ndeps;
+	hdr.fsize = m->fsize;
+
+	for (i = 0; i < n; i++) {
+		hdr.strings_len += strlen(index_path(m, i)) + 1;
+	}
+
+	/* keep the string table non-empty, so there's always a final NUL */
+	if (!hdr.strings_len) {
+		hdr.strings_len = 1;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	for (i = 0; i < n; i++) {
+		struct manifest_chunk * c = index_rec(m, i);
+		struct cfidx_chunk rec;
+
+		rec.path = off;
+		rec.fsize = c->fsize;
+		rec.start = i < m->nchunks ? start : 0;
+		rec.mtime_sec = c->mtime.tv_sec;
+		rec.mtime_nsec = c->mtime.tv_nsec;
+		rec.offset = c->offset;
+		rec.csize = c->csize;
+		rec.slice = c->slice;
+		rec.kind = c->kind;
+
+		fwrite(&rec, sizeof(rec), 1, fp);
+
+		off += strlen(index_path(m, i)) + 1;
+		start += c->fsize;
+	}
+
+	for (i = 0; i < n; i++) {
+		fwrite(index_path(m, i), strlen(index_path(m, i)) + 1, 1, fp);
+	}
+
+	if (!n) {
+		fputc(0, fp);
+	}
+}
+
+/* writes the compiled sidecar of a freshly parsed manifest */
+static int manifest_write_index(struct manifest * m)
+{
+	char ipath[PATH_MAX];
+	char tpath[PATH_MAX];
+	FILE * fp;
+	int fd;
+
+	if (snprintf(ipath, sizeof(ipath), "%s" CFIDX_SUFFIX, m->path)
+	    >= (int) sizeof(ipath)
+	    || snprintf(tpath, sizeof(tpath), "%s.tmp", ipath)
+	    >= (int) sizeof(tpath)) {
+		return -ENAMETOOLONG;
+	}
+
+	fd = openat(src_fd, tpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	fp = fdopen(fd, "w");
+
+	if (!fp) {
+		int err = -errno;
+
+		close(fd);
+		unlinkat(src_fd, tpath, 0);
+		return err;
+	}
+
+	cfidx_encode(m, fp);
+
+	if (fclose(fp) != 0) {
+		int err = -errno;
+
+		unlinkat(src_fd, tpath, 0);
+		return err;
+	}
+
+	if (renameat(src_fd, tpath, src_fd, ipath) != 0) {
+		int err = -errno;
+
+		unlinkat(src_fd, tpath, 0);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+  concatfs --compile manifest...: (re)writes the sidecars of the given
+  manifests. Chunks are resolved against the manifest's real directory,
+  those below it are stored relative to it.
+*/
+
+static int compile_manifests(int argc, char ** argv)
+{
+	int rv = 0;
+	int i;
+
+	task_pool_start(&io_pool, options.io_threads);
+
+	for (i = 0; i < argc; i++) {
+		char rpath[PATH_MAX];
+		struct manifest * m;
+		struct stat st;
+		int err;
+
+		if (!realpath(argv[i], rpath) || stat(rpath, &st) != 0) {
+			perror(argv[i]);
+			rv = 1;
+			continue;
+		}
+
+		m = manifest_parse(rpath, &st);
+
+		if (!m) {
+			perror(argv[i]);
+			rv = 1;
+			continue;
+		}
+
+		err = manifest_write_index(m);
+
+		if (err) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(-err));
+			rv = 1;
+		}
+
+		manifest_free(m);
+	}
+
+	return rv;
+}
+
+static int manifest_chunks_changed(struct manifest * m)
+{
+	struct path_stat * s;
+	size_t nchunks = m->nchunks;
+	size_t n = nchunks + m->ndeps;
+	int rv = 0;
+	size_t i;
+
+	s = (struct path_stat *) calloc(sizeof(struct path_stat), n ? n : 1);
+
+	for (i = 0; i < nchunks; i++) {
+		if (m->chunks[i].kind != CHUNK_ZERO) {
+			s[i].path = m->chunks[i].path;
+		}
+	}
+	for (i = 0; i < m->ndeps; i++) {
+		s[nchunks + i].path = m->deps[i].path;
+	}
+
+	stat_paths(s, n);
+
+	/* writes through concatfs update the recorded sizes under the lock */
+	pthread_mutex_lock(&manifest_lock);
+
+	for (i = 0; i < n && !rv; i++) {
+		struct manifest_chunk * c = i < nchunks
+			? &m->chunks[i] : &m->deps[i - nchunks];
+
+		if (c->kind == CHUNK_ZERO) {
+			continue;
+		}
+
+		rv = s[i].rv != 0
+			|| (c->kind == CHUNK_PATTERN ? s[i].st.st_size == 0
+			    : c->kind == CHUNK_ZSTD
+			    ? s[i].st.st_size != c->csize
+			    : c->slice ? s[i].st.st_size < c->offset + c->fsize
+			    : s[i].st.st_size != c->fsize)
+			|| !timespec_equal(&s[i].st.st_mtim, &c->mtime);
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	free(s);
+
+	return rv;
+}
+
+/* called with manifest_lock held */
+static struct manifest * manifest_lookup(unsigned int h, const char * path)
+{
+	struct manifest * m;
+
+	for (m = manifests[h]; m; m = m->next) {
+		if (strcmp(m->path, path) == 0) {
+			return m;
+		}
+	}
+
+	return 0;
+}
+
+/*
+  unlinks m from the cache and drops the cache's reference,
+  called with manifest_lock held
+*/
+static void manifest_unhash(struct manifest * m)
+{
+	struct manifest ** p = &manifests[hash_path(m->path)];
+
+	for (; *p; p = &(*p)->next) {
+		if (*p == m) {
+			*p = m->next;
+			m->next = 0;
+			m->cached = 0;
+			manifest_unref(m);
+			return;
+		}
+	}
+}
+
+/*
+  The low-level FUSE API names files by inode number only. Every inode
+  the kernel holds lookup references to has a node, and the node's
+  address is its inode number. Nodes remember their parent and name, so
+  a source path is only put together by the calls that need one, and a
+  rename just moves the node.
+
+  A node is freed once the kernel has forgotten it and no child refers
+  to it anymore. Unlinked nodes are only dropped from the hash until
+  then. Whether a node is a concat file is decided when it's created, so
+  open handles always match it; a rename that changes that replaces the
+  node on the next lookup.
+*/
+
+#define NODE_HASH_SIZE 65536
+
+enum node_kind {
+	NODE_SOURCE,
+	NODE_STATS_DIR,
+	NODE_STATS_FILE,
+};
+
+struct node {
+	struct node * next;
+	struct node * parent;
+	char * name;
+	uint64_t nlookup;
+	unsigned int children;
+	enum node_kind kind;
+	int concat;
+	int hashed;
+
+	/* the manifest last used for a concat file, under manifest_lock */
+	struct manifest * m;
+
+	/* with -o passthrough: opens and their shared backing file */
+	unsigned int opens;
+	int backing_id;
+	dev_t backing_dev;
+	ino_t backing_ino;
+};
+
+static struct node * nodes[NODE_HASH_SIZE];
+static pthread_mutex_t node_lock;
+
+static struct node root_node = {
+	.name = "",
+	.hashed = 1,
+};
+
+static struct node stats_dir_node = {
+	.parent = &root_node,
+	.name = STATS_DIR,
+	.kind = NODE_STATS_DIR,
+	.hashed = 1,
+};
+
+static struct node stats_file_node = {
+	.parent = &stats_dir_node,
+	.name = STATS_FILE,
+	.kind = NODE_STATS_FILE,
+	.hashed = 1,
+};
+
+static struct node * node_get(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID) {
+		return &root_node;
+	}
+
+	return (struct node *) (uintptr_t) ino;
+}
+
+static fuse_ino_t node_ino(struct node * n)
+{
+	return n == &root_node ? FUSE_ROOT_ID : (fuse_ino_t) (uintptr_t) n;
+}
+
+static unsigned int node_hash(struct node * parent, const char * name)
+{
+	uint64_t h = 14695981039346656037ULL ^ (uintptr_t) parent;
+
+	for (; *name; name++) {
+		h = (h ^ (unsigned char) *name) * 1099511628211ULL;
+	}
+
+	return (h ^ (h >> 32)) % NODE_HASH_SIZE;
+}
+
+/* called with node_lock held */
+static struct node * node_find(struct node * parent, const char * name)
+{
+	struct node * n = nodes[node_hash(parent, name)];
+
+	for (; n; n = n->next) {
+		if (n->parent == parent && strcmp(n->name, name) == 0) {
+			return n;
+		}
+	}
+
+	return 0;
+}
+
+/* called with node_lock held */
+static void node_link(struct node * n)
+{
+	unsigned int h = node_hash(n->parent, n->name);
+
+	n->next = nodes[h];
+	nodes[h] = n;
+	n->hashed = 1;
+}
+
+/* called with node_lock held */
+static void node_unlink(struct node * n)
+{
+	struct node ** p = &nodes[node_hash(n->parent, n->name)];
+
+	for (; *p; p = &(*p)->next) {
+		if (*p == n) {
+			*p = n->next;
+			break;
+		}
+	}
+
+	n->next = 0;
+	n->hashed = 0;
+}
+
+/*
+  frees n and the parents that are left unreferenced by that, called
+  with node_lock held
+*/
+static void node_release(struct node * n)
+{
+	while (n->kind == NODE_SOURCE && n != &root_node
+	       && n->nlookup == 0 && n->children == 0) {
+		struct node * parent = n->parent;
+
+		if (n->hashed) {
+			node_unlink(n);
+		}
+
+		parent->children--;
+
+		manifest_put(n->m);
+		free(n->name);
+		free(n);
+
+		n = parent;
+	}
+}
+
+/*
+  returns the node of name in parent with one more lookup reference,
+  adding it if the kernel didn't know it yet
+*/
+static struct node * node_lookup(struct node * parent, const char * name)
+{
+	int concat = is_concatfs_file(name);
+	struct node * n;
+
+	pthread_mutex_lock(&node_lock);
+
+	n = node_find(parent, name);
+
+	/* renamed across concat and plain names, the kernel gets a new one */
+	if (n && n->concat != concat) {
+		node_unlink(n);
+		node_release(n);
+		n = 0;
+	}
+
+	if (!n) {
+		n = (struct node *) calloc(sizeof(struct node), 1);
+		n->parent = parent;
+		n->name = strdup(name);
+		n->concat = concat;
+		parent->children++;
+		node_link(n);
+	}
+
+	n->nlookup++;
+
+	pthread_mutex_unlock(&node_lock);
+
+	return n;
+}
+
+static void node_forget(struct node * n, uint64_t nlookup)
+{
+	pthread_mutex_lock(&node_lock);
+
+	n->nlookup -= nlookup;
+	node_release(n);
+
+	pthread_mutex_unlock(&node_lock);
+}
+
+/* called after name in parent was unlinked in the source */
+static void node_remove(struct node * parent, const char * name)
+{
+	struct node * n;
+
+	pthread_mutex_lock(&node_lock);
+
+	if ((n = node_find(parent, name))) {
+		node_unlink(n);
+		node_release(n);
+	}
+
+	pthread_mutex_unlock(&node_lock);
+}
+
+/* called with node_lock held */
+static void node_move(struct node * n, struct node * parent, const char * name)
+{
+	struct node * old = n->parent;
+	struct manifest * m;
+
+	free(n->name);
+	n->name = strdup(name);
+	n->parent = parent;
+	parent->children++;
+	old->children--;
+	node_link(n);
+
+	/* its chunk paths may resolve differently from the new place */
+	pthread_mutex_lock(&manifest_lock);
+	m = n->m;
+	n->m = 0;
+	if (m) {
+		manifest_unref(m);
+	}
+	pthread_mutex_unlock(&manifest_lock);
+
+	node_release(old);
+}
+
+/* called after the source was renamed, flags as for renameat2 */
+static void node_rename(struct node * parent, const char * name,
+			struct node * newparent, const char * newname,
+			unsigned int flags)
+{
+	struct node * n;
+	struct node * t;
+
+	pthread_mutex_lock(&node_lock);
+
+	n = node_find(parent, name);
+	t = node_find(newparent, newname);
+
+	if (n) {
+		node_unlink(n);
+	}
+	if (t) {
+		node_unlink(t);
+	}
+
+	if (n) {
+		node_move(n, newparent, newname);
+	}
+
+	if (t && (flags & RENAME_EXCHANGE)) {
+		node_move(t, parent, name);
+	} else if (t) {
+		node_release(t);
+	}
+
+	pthread_mutex_unlock(&node_lock);
+}
+
+/*
+  puts together the path of n relative to src_fd, fails with -ENOENT
+  once n or one of its parents has been unlinked
+*/
+static int node_path(struct node * n, char * buf, size_t size)
+{
+	struct node * p;
+	size_t len = 0;
+	int rv = 0;
+
+	if (n == &root_node) {
+		snprintf(buf, size, ".");
+		return 0;
+	}
+
+	pthread_mutex_lock(&node_lock);
+
+	for (p = n; p != &root_node; p = p->parent) {
+		if (!p->hashed) {
+			rv = -ENOENT;
+			break;
+		}
+		len += strlen(p->name) + 1;
+	}
+
+	if (rv == 0 && len > size) {
+		rv = -ENAMETOOLONG;
+	}
+
+	if (rv == 0) {
+		buf[--len] = '\0';
+
+		for (p = n; p != &root_node; p = p->parent) {
+			size_t l = strlen(p->name);
+
+			len -= l;
+			memcpy(buf + len, p->name, l);
+
+			if (len) {
+				buf[--len] = '/';
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&node_lock);
+
+	return rv;
+}
+
+/* the path of name in the directory at path, as node_path gives it */
+static int child_path(const char * path, const char * name,
+		      char * buf, size_t size)
+{
+	int len;
+
+	if (strcmp(path, ".") == 0) {
+		len = snprintf(buf, size, "%s", name);
+	} else {
+		len = snprintf(buf, size, "%s/%s", path, name);
+	}
+
+	return (size_t) len < size ? 0 : -ENAMETOOLONG;
+}
+
+static int node_child_path(struct node * parent, const char * name,
+			   char * buf, size_t size)
+{
+	char path[PATH_MAX];
+	int rv = node_path(parent, path, sizeof(path));
+
+	if (rv) {
+		return rv;
+	}
+
+	return child_path(path, name, buf, size);
+}
+
+/*
+  the node of a path relative to src_fd with a lookup reference held on
+  it, 0 if the kernel doesn't know that path
+*/
+static struct node * node_find_path(const char * path)
+{
+	char name[NAME_MAX + 1];
+	struct node * n = &root_node;
+
+	pthread_mutex_lock(&node_lock);
+
+	while (n && *path) {
+		const char * end = strchrnul(path, '/');
+		size_t len = end - path;
+
+		if (len > NAME_MAX) {
+			n = 0;
+			break;
+		}
+
+		memcpy(name, path, len);
+		name[len] = '\0';
+
+		n = node_find(n, name);
+		path = *end ? end + 1 : end;
+	}
+
+	if (n) {
+		n->nlookup++;
+	}
+
+	pthread_mutex_unlock(&node_lock);
+
+	return n;
+}
+
+/*
+  With -o watch, a thread follows inotify events on the directories of
+  cached manifests, their chunks and nested manifests. A change to any of
+  these drops the manifests listing it from the cache and invalidates
+  them in the kernel, so they are reparsed on the next access.
+
+  watch_names holds the paths cached manifests depend on, an event is
+  only acted on for those. A manifest skips the chunk_ttl re-stat once it
+  is watched: its names are in watch_names and a re-stat after that
+  found it unchanged, so nothing can have slipped by in between.
+
+  Names are kept without "." components and repeated slashes, the form
+  paths built from an event's directory and name have, so "./a.MTS" in
+  a manifest matches an event for "a.MTS". A path that doesn't fit that
+  form keeps its manifest on the re-stat.
+*/
+
+#define WATCH_HASH_SIZE 1024
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM \
+		    | IN_MOVED_TO | IN_CREATE | IN_DELETE)
+
+struct watch_dir {
+	struct watch_dir * next;
+	int wd;
+	char path[];
+};
+
+struct watch_name {
+	struct watch_name * next;
+	char path[];
+};
+
+static struct watch_dir * watch_dirs[WATCH_HASH_SIZE];
+static struct watch_name * watch_names[WATCH_HASH_SIZE];
+static pthread_mutex_t watch_lock;
+static int watch_fd = -1;
+static struct fuse_session * concatfs_se = 0;
+
+/* writes path without "." components and repeated slashes to buf */
+static int watch_path_canon(const char * path, char * buf, size_t size)
+{
+	const char * p = path;
+	size_t len = 0;
+
+	if (*p == '/') {
+		buf[len++] = '/';
+	}
+
+	while (*p) {
+		size_t n;
+
+		while (*p == '/') {
+			p++;
+		}
+
+		n = strcspn(p, "/");
+
+		if (n == 0 || (n == 1 && p[0] == '.')) {
+			p += n;
+			continue;
+		}
+
+		if (len + (len && buf[len - 1] != '/') + n >= size) {
+			return -ENAMETOOLONG;
+		}
+
+		if (len && buf[len - 1] != '/') {
+			buf[len++] = '/';
+		}
+
+		memcpy(buf + len, p, n);
+		len += n;
+		p += n;
+	}
+
+	if (len == 0) {
+		buf[len++] = '.';
+	}
+
+	buf[len] = 0;
+
+	return 0;
+}
+
+/* called with watch_lock held */
+static struct watch_dir * watch_dir_find(const char * path)
+{
+	struct watch_dir * d = watch_dirs[hash_path(path) % WATCH_HASH_SIZE];
+
+	for (; d; d = d->next) {
+		if (strcmp(d->path, path) == 0) {
+			return d;
+		}
+	}
+
+	return 0;
+}
+
+/* adds path's directory to the inotify watches, called with watch_lock held */
+static int watch_dir_add(const char * path)
+{
+	char tpath[PATH_MAX];
+	char wpath[PATH_MAX + 32];
+	const char * dpath;
+	struct watch_dir * d;
+	unsigned int h;
+	int wd;
+
+	strncpy(tpath, path, sizeof(tpath));
+	tpath[PATH_MAX - 1] = 0;
+	dpath = dirname(tpath);
+
+	if (watch_dir_find(dpath)) {
+		return 0;
+	}
+
+	if (dpath[0] == '/' || src_fd == AT_FDCWD) {
+		snprintf(wpath, sizeof(wpath), "%s", dpath);
+	} else {
+		snprintf(wpath, sizeof(wpath), "/proc/self/fd/%d/%s",
+			 src_fd, dpath);
+	}
+
+	wd = inotify_add_watch(watch_fd, wpath, WATCH_MASK | IN_ONLYDIR);
+
+	if (wd < 0) {
+		return -errno;
+	}
+
+	h = hash_path(dpath) % WATCH_HASH_SIZE;
+
+	d = (struct watch_dir *) malloc(sizeof(struct watch_dir)
+					+ strlen(dpath) + 1);
+	d->wd = wd;
+	strcpy(d->path, dpath);
+	d->next = watch_dirs[h];
+	watch_dirs[h] = d;
+
+	return 0;
+}
+
+/* called with watch_lock held */
+static struct watch_name ** watch_name_find(const char * path)
+{
+	struct watch_name ** p = &watch_names[hash_path(path) % WATCH_HASH_SIZE];
+
+	for (; *p; p = &(*p)->next) {
+		if (strcmp((*p)->path, path) == 0) {
+			return p;
+		}
+	}
+
+	return p;
+}
+
+/* called with watch_lock held */
+static int watch_name_add(const char * rpath)
+{
+	char path[PATH_MAX];
+	struct watch_name ** p;
+	int rv;
+
+	if ((rv = watch_path_canon(rpath, path, sizeof(path))) < 0) {
+		return rv;
+	}
+
+	p = watch_name_find(path);
+
+	if (*p) {
+		return 0;
+	}
+
+	if ((rv = watch_dir_add(path)) < 0) {
+		return rv;
+	}
+
+	*p = (struct watch_name *) malloc(sizeof(struct watch_name)
+					  + strlen(path) + 1);
+	strcpy((*p)->path, path);
+	(*p)->next = 0;
+
+	return 0;
+}
+
+/* returns 0 once all paths m depends on are watched */
+static int watch_manifest(struct manifest * m)
+{
+	int rv;
+	size_t i;
+
+	/* remote chunks can only be polled */
+	for (i = 0; i < m->nchunks; i++) {
+		if (m->chunks[i].kind == CHUNK_REMOTE) {
+			return -EREMOTE;
+		}
+	}
+
+	pthread_mutex_lock(&watch_lock);
+
+	rv = watch_name_add(m->path);
+
+	for (i = 0; i < m->nchunks && rv == 0; i++) {
+		if (m->chunks[i].kind != CHUNK_ZERO) {
+			rv = watch_name_add(m->chunks[i].path);
+		}
+	}
+	for (i = 0; i < m->ndeps && rv == 0; i++) {
+		rv = watch_name_add(m->deps[i].path);
+	}
+
+	pthread_mutex_unlock(&watch_lock);
+
+	return rv;
+}
+
+/* whether rpath, as listed in a manifest, is the watch name path */
+static int watch_path_is(const char * rpath, const char * path)
+{
+	char cpath[PATH_MAX];
+
+	return watch_path_canon(rpath, cpath, sizeof(cpath)) == 0
+		&& strcmp(cpath, path) == 0;
+}
+
+static int manifest_lists(struct manifest * m, const char * path)
+{
+	size_t i;
+
+	if (watch_path_is(m->path, path)) {
+		return 1;
+	}
+
+	for (i = 0; i < m->nchunks; i++) {
+		if (watch_path_is(m->chunks[i].path, path)) {
+			return 1;
+		}
+	}
+	for (i = 0; i < m->ndeps; i++) {
+		if (watch_path_is(m->deps[i].path, path)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+  drops the cached manifests that depend on path, or all of them for a
+  0 path, and invalidates them in the kernel
+*/
+static void watch_invalidate(const char * path)
+{
+	char ** fpaths = 0;
+	size_t n = 0;
+	size_t i;
+
+	pthread_mutex_lock(&manifest_lock);
+
+	for (i = 0; i < MANIFEST_HASH_SIZE; i++) {
+		struct manifest * m = manifests[i];
+
+		while (m) {
+			struct manifest * next = m->next;
+
+			if (!path || manifest_lists(m, path)) {
+				fpaths = (char **) realloc(
+					fpaths, (n + 1) * sizeof(char *));
+				fpaths[n++] = strdup(m->path);
+				manifest_unhash(m);
+			}
+
+			m = next;
+		}
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	for (i = 0; i < n; i++) {
+		struct node * node = concatfs_se ? node_find_path(fpaths[i]) : 0;
+
+		/* the held reference keeps the inode number valid meanwhile */
+		if (node) {
+			fuse_lowlevel_notify_inval_inode(
+				concatfs_se, node_ino(node), 0, 0);
+			node_forget(node, 1);
+		}
+		free(fpaths[i]);
+	}
+
+	free(fpaths);
+}
+
+static void watch_event(const struct inotify_event * ev)
+{
+	char path[PATH_MAX];
+	char ** changed = 0;
+	size_t n = 0;
+	size_t i;
+
+	pthread_mutex_lock(&watch_lock);
+
+	for (i = 0; i < WATCH_HASH_SIZE; i++) {
+		struct watch_dir ** p = &watch_dirs[i];
+
+		while (*p) {
+			struct watch_dir * d = *p;
+			struct watch_name ** q;
+
+			if (d->wd != ev->wd) {
+				p = &d->next;
+				continue;
+			}
+
+			/* the directory is gone, it's watched anew if needed */
+			if (ev->mask & IN_IGNORED) {
+				*p = d->next;
+				free(d);
+				continue;
+			}
+
+			p = &d->next;
+
+			if (!ev->len) {
+				continue;
+			}
+
+			if (strcmp(d->path, ".") == 0) {
+				snprintf(path, sizeof(path), "%s", ev->name);
+			} else {
+				snprintf(path, sizeof(path), "%s%s%s", d->path,
+					 strcmp(d->path, "/") ? "/" : "",
+					 ev->name);
+			}
+
+			q = watch_name_find(path);
+
+			if (*q) {
+				struct watch_name * w = *q;
+
+				*q = w->next;
+				free(w);
+
+				changed = (char **) realloc(
+					changed, (n + 1) * sizeof(char *));
+				changed[n++] = strdup(path);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&watch_lock);
+
+	for (i = 0; i < n; i++) {
+		watch_invalidate(changed[i]);
+		free(changed[i]);
+	}
+
+	free(changed);
+}
+
+/* events were lost, so nothing cached can be trusted anymore */
+static void watch_overflow()
+{
+	size_t i;
+
+	pthread_mutex_lock(&watch_lock);
+
+	for (i = 0; i < WATCH_HASH_SIZE; i++) {
+		while (watch_names[i]) {
+			struct watch_name * w = watch_names[i];
+
+			watch_names[i] = w->next;
+			free(w);
+		}
+	}
+
+	pthread_mutex_unlock(&watch_lock);
+
+	watch_invalidate(0);
+}
+
+static void * watch_worker(void * arg)
+{
+	char buf[64 * 1024]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		ssize_t len = read(watch_fd, buf, sizeof(buf));
+		char * p;
+
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (p = buf; p < buf + len; ) {
+			struct inotify_event * ev = (struct inotify_event *) p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				watch_overflow();
+			} else {
+				watch_event(ev);
+			}
+
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+
+	return 0;
+}
+
+/*
+  Returns a referenced manifest for path, parsing it only if the cached
+  entry is missing or stale. st may hold a fresh stat of path, in which
+  case the manifest itself isn't stat'ed again.
+*/
+
+/*
+  -o state_file=FILE keeps the manifest cache across restarts. Every
+  cached manifest is compiled into FILE on unmount, the same way as a
+  sidecar, and FILE is read back on mount. An entry is used on the first
+  lookup of its manifest if the manifest is unchanged, and its chunks
+  are checked after chunk_ttl like those of a sidecar. Entries that
+  weren't looked up are carried over to the next state file.
+*/
+
+#define STATE_MAGIC "CFSTATE\1"
+
+struct state_entry {
+	struct state_entry * next;
+	char * path;
+	size_t len;
+
+	/* the compiled manifest, aligned for its header */
+	uint64_t data[];
+};
+
+/* under manifest_lock */
+static struct state_entry * state_entries[MANIFEST_HASH_SIZE];
+static int state_dir_fd = -1;
+static char * state_name = 0;
+
+/* takes path's entry from the state file, 0 if it has none or it's stale */
+static struct manifest * manifest_load_state(const char * path,
+					     const struct stat * st)
+{
+	struct state_entry ** p = &state_entries[hash_path(path)];
+	struct state_entry * e;
+	struct manifest * rv;
+	size_t i;
+
+	pthread_mutex_lock(&manifest_lock);
+
+	for (; *p && strcmp((*p)->path, path) != 0; p = &(*p)->next) {
+	}
+
+	if ((e = *p)) {
+		*p = e->next;
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	if (!e) {
+		return 0;
+	}
+
+	/* the entry goes away, so the manifest gets its own paths */
+	if ((rv = cfidx_decode(e->data, e->len, path, st))) {
+		for (i = 0; i < rv->nchunks; i++) {
+			rv->chunks[i].path = strdup(rv->chunks[i].path);
+		}
+		for (i = 0; i < rv->ndeps; i++) {
+			rv->deps[i].path = strdup(rv->deps[i].path);
+		}
+		free(rv->strings);
+		rv->strings = 0;
+
+		stat_add(&thread_stats_get()->state_hits, 1);
+	}
+
+	free(e->path);
+	free(e);
+
+	return rv;
+}
+
+static struct manifest * manifest_get(const char * path,
+				      const struct stat * st)
+{
+	unsigned int h = hash_path(path);
+	struct manifest * m;
+	struct manifest * n;
+	struct stat stbuf;
+	time_t now = now_seconds();
+	int revalidate = 0;
+
+	if (!st || !S_ISREG(st->st_mode)) {
+		st = (fstatat(src_fd, path, &stbuf, 0) == 0) ? &stbuf : 0;
+	}
+
+	pthread_mutex_lock(&manifest_lock);
+
+	m = manifest_lookup(h, path);
+
+	if (m && st && manifest_matches(m, st)) {
+		m->refcount++;
+
+		if (m->watched != 2
+		    && now - m->validated >= (time_t) options.chunk_ttl) {
+			m->validated = now;
+			revalidate = 1;
+		}
+	} else if (m) {
+		manifest_unhash(m);
+		m = 0;
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	if (!st) {
+		return 0;
+	}
+
+	if (m && !(revalidate && manifest_chunks_changed(m))) {
+		if (revalidate && m->watched == 1) {
+			pthread_mutex_lock(&manifest_lock);
+			m->watched = 2;
+			pthread_mutex_unlock(&manifest_lock);
+		}
+
+		stat_add(&thread_stats_get()->manifest_hits, 1);
+		return m;
+	}
+
+	/*
+	  a sidecar or state entry whose chunks turned out to be changed is
+	  stale as well, so only the text manifest is trusted then
+	*/
+	n = m ? 0 : manifest_load_state(path, st);
+
+	if (!n && !m) {
+		n = manifest_load_index(path, st);
+	}
+
+	if (!n) {
+		n = manifest_parse(path, st);
+	}
+
+	stat_add(&thread_stats_get()->manifest_parses, 1);
+
+	pthread_mutex_lock(&manifest_lock);
+
+	if (m) {
+		manifest_unhash(m);
+		manifest_unref(m);
+	}
+
+	if (n) {
+		if ((m = manifest_lookup(h, path))) {
+			manifest_unhash(m);
+		}
+
+		n->next = manifests[h];
+		manifests[h] = n;
+		n->cached = 1;
+		n->refcount++;
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	/* after it's cached, so events from now on find it */
+	if (n && watch_fd >= 0 && watch_manifest(n) == 0) {
+		pthread_mutex_lock(&manifest_lock);
+		n->watched = 1;
+		pthread_mutex_unlock(&manifest_lock);
+	}
+
+	return n;
+}
+
+/* reads the state file, a missing one is fine */
+static int state_load(const char * path)
+{
+	char dpath[PATH_MAX];
+	char bpath[PATH_MAX];
+	char magic[8];
+	uint64_t len[2];
+	FILE * fp;
+
+	snprintf(dpath, sizeof(dpath), "%s", path);
+	snprintf(bpath, sizeof(bpath), "%s", path);
+
+	state_dir_fd = open(dirname(dpath), O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+	if (state_dir_fd < 0) {
+		return -errno;
+	}
+
+	state_name = strdup(basename(bpath));
+
+	if (!(fp = fopen(path, "r"))) {
+		return errno == ENOENT ? 0 : -errno;
+	}
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1
+	    || memcmp(magic, STATE_MAGIC, sizeof(magic)) != 0) {
+		fclose(fp);
+		return 0;
+	}
+
+	/* path length with its NUL, length of the compiled manifest */
+	while (fread(len, sizeof(len), 1, fp) == 1) {
+		struct state_entry * e;
+		unsigned int h;
+
+		if (len[0] == 0 || len[0] > PATH_MAX || len[1] > (1 << 30)) {
+			break;
+		}
+
+		e = (struct state_entry *) malloc(sizeof(struct state_entry)
+						  + len[1]);
+		e->path = (char *) malloc(len[0]);
+		e->len = len[1];
+
+		if (fread(e->path, len[0], 1, fp) != 1
+		    || (len[1] && fread(e->data, len[1], 1, fp) != 1)
+		    || e->path[len[0] - 1] != 0) {
+			free(e->path);
+			free(e);
+			break;
+		}
+
+		h = hash_path(e->path);
+		e->next = state_entries[h];
+		state_entries[h] = e;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static void state_write(FILE * fp, const char * path, size_t len)
+{
+	uint64_t hdr[2] = { strlen(path) + 1, len };
+
+	fwrite(hdr, sizeof(hdr), 1, fp);
+	fwrite(path, hdr[0], 1, fp);
+}
+
+/* writes the cached manifests and the unused entries to the state file */
+static int state_save()
+{
+	char tname[PATH_MAX];
+	FILE * fp;
+	size_t i;
+	int fd;
+
+	snprintf(tname, sizeof(tname), "%s.tmp", state_name);
+
+	fd = openat(state_dir_fd, tname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	fp = fdopen(fd, "w");
+
+	if (!fp) {
+		int err = -errno;
+
+		close(fd);
+		unlinkat(state_dir_fd, tname, 0);
+		return err;
+	}
+
+	fwrite(STATE_MAGIC, 8, 1, fp);
+
+	pthread_mutex_lock(&manifest_lock);
+
+	for (i = 0; i < MANIFEST_HASH_SIZE; i++) {
+		struct state_entry * e;
+		struct manifest * m;
+
+		for (m = manifests[i]; m; m = m->next) {
+			state_write(fp, m->path, cfidx_size(m));
+			cfidx_encode(m, fp);
+		}
+		for (e = state_entries[i]; e; e = e->next) {
+			state_write(fp, e->path, e->len);
+			fwrite(e->data, e->len, 1, fp);
+		}
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	if (fclose(fp) != 0) {
+		int err = -errno;
+
+		unlinkat(state_dir_fd, tname, 0);
+		return err;
+	}
+
+	if (renameat(state_dir_fd, tname, state_dir_fd, state_name) != 0) {
+		int err = -errno;
+
+		unlinkat(state_dir_fd, tname, 0);
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+  -o warm loads every manifest below the source directory into the
+  cache at mount, so the first listings and opens after a restart don't
+  all parse cold. Directories are read by tasks of one group on io_pool.
+  At most half the pool runs warm tasks at a time: further directories
+  wait in the walk's list, and a task that is done with its directory
+  goes on with the next one from there. Symlinks to directories aren't
+  followed.
+*/
+
+struct warm_walk {
+	struct task_group g;
+	pthread_mutex_t lock;
+	struct warm_dir * queue;
+	struct warm_dir ** tail;
+	unsigned int running;
+	unsigned int max_running;
+
+	void (*run)(struct task * t);
+};
+
+struct warm_dir {
+	struct task task;
+	struct warm_walk * walk;
+	struct warm_dir * next;
+	char path[];
+};
+
+/* submits a task for path, or leaves it in the walk's list */
+static void warm_dir_add(struct warm_walk * walk, const char * path)
+{
+	struct warm_dir * w = (struct warm_dir *) malloc(
+		sizeof(struct warm_dir) + strlen(path) + 1);
+
+	strcpy(w->path, path);
+	w->walk = walk;
+	w->next = 0;
+
+	pthread_mutex_lock(&walk->lock);
+
+	if (walk->running < walk->max_running) {
+		walk->running++;
+	} else {
+		*walk->tail = w;
+		walk->tail = &w->next;
+		w = 0;
+	}
+
+	pthread_mutex_unlock(&walk->lock);
+
+	if (w) {
+		w->task.fn = walk->run;
+		task_submit(&walk->g, &w->task);
+	}
+}
+
+/* takes the next directory of the walk's list, or gives up the slot */
+static struct warm_dir * warm_dir_next(struct warm_walk * walk)
+{
+	struct warm_dir * w;
+
+	pthread_mutex_lock(&walk->lock);
+
+	if ((w = walk->queue)) {
+		walk->queue = w->next;
+		if (!walk->queue) {
+			walk->tail = &walk->queue;
+		}
+	} else {
+		walk->running--;
+	}
+
+	pthread_mutex_unlock(&walk->lock);
+
+	return w;
+}
+
+/* loads the manifests in w, queues its subdirectories */
+static void warm_dir_read(struct warm_dir * w)
+{
+	struct dirent * de;
+	DIR * dp = 0;
+	int fd = openat(src_fd, w->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd >= 0 && !(dp = fdopendir(fd))) {
+		close(fd);
+	}
+
+	while (dp && (de = readdir(dp))) {
+		char path[PATH_MAX];
+		unsigned char type = de->d_type;
+		struct stat st;
+
+		if (strcmp(de->d_name, ".") == 0
+		    || strcmp(de->d_name, "..") == 0
+		    || child_path(w->path, de->d_name, path, sizeof(path))) {
+			continue;
+		}
+
+		if (type == DT_UNKNOWN
+		    && fstatat(src_fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+			type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+		}
+
+		if (type == DT_DIR) {
+			warm_dir_add(w->walk, path);
+		} else if (is_concatfs_file(path)) {
+			struct manifest * m = manifest_get(path, 0);
+
+			if (m) {
+				stat_add(&thread_stats_get()->warmed, 1);
+			}
+			manifest_put(m);
+		}
+	}
+
+	if (dp) {
+		closedir(dp);
+	}
+}
+
+static void warm_dir_run(struct task * t)
+{
+	struct warm_dir * w = (struct warm_dir *) t;
+	struct warm_walk * walk = w->walk;
+
+	while (w) {
+		warm_dir_read(w);
+		free(w);
+		w = warm_dir_next(walk);
+	}
+}
+
+static void * warm_worker(void * arg)
+{
+	struct warm_walk walk;
+
+	task_group_init(&walk.g, &io_pool);
+	pthread_mutex_init(&walk.lock, NULL);
+	walk.queue = 0;
+	walk.tail = &walk.queue;
+	walk.running = 0;
+	walk.max_running = options.io_threads / 2;
+	walk.run = warm_dir_run;
+
+	if (walk.max_running == 0) {
+		walk.max_running = 1;
+	}
+
+	warm_dir_add(&walk, ".");
+
+	task_group_wait(&walk.g);
+	task_group_destroy(&walk.g);
+	pthread_mutex_destroy(&walk.lock);
+
+	return 0;
+}
+
+/*
+  Chunk fds are opened on the first read that touches a chunk and live
+  in a global pool capped at max_chunk_fds. The pool is a CLOCK ring:
+  readers only set a chunk's referenced bit, the eviction hand clears it
+  and closes fds that weren't used since its last pass.
+
+  Readers pin a chunk through its users count while they use the fd,
+  and eviction only closes fds it can switch from 0 users to -1.
+*/
+
+static pthread_mutex_t fd_pool_lock;
+static struct chunk * fd_pool_hand = 0;
+static unsigned int fd_pool_size = 0;
+
+/* called with fd_pool_lock held */
+static void fd_pool_unlink(struct chunk * c)
+{
+	if (c->pool_next == c) {
+		fd_pool_hand = 0;
+	} else {
+		c->pool_prev->pool_next = c->pool_next;
+		c->pool_next->pool_prev = c->pool_prev;
+
+		if (fd_pool_hand == c) {
+			fd_pool_hand = c->pool_next;
+		}
+	}
+
+	c->pool_prev = c->pool_next = 0;
+	fd_pool_size--;
+}
+
+/* called with fd_pool_lock held, inserts c right behind the hand */
+static void fd_pool_insert(struct chunk * c)
+{
+	if (!fd_pool_hand) {
+		c->pool_prev = c->pool_next = c;
+		fd_pool_hand = c;
+	} else {
+		c->pool_next = fd_pool_hand;
+		c->pool_prev = fd_pool_hand->pool_prev;
+		c->pool_prev->pool_next = c;
+		fd_pool_hand->pool_prev = c;
+	}
+
+	fd_pool_size++;
+}
+
+/* called with fd_pool_lock held */
+static void fd_pool_evict()
+{
+	unsigned int scan = 2 * fd_pool_size;
+
+	while (fd_pool_size > options.max_chunk_fds && scan-- > 0) {
+		struct chunk * c = fd_pool_hand;
+		int users = 0;
+
+		fd_pool_hand = c->pool_next;
+
+		if (__atomic_exchange_n(&c->referenced, 0, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&c->users, &users, -1, 0,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		fd_pool_unlink(c);
+
+		close(c->fd);
+		c->fd = -1;
+
+		__atomic_store_n(&c->users, 0, __ATOMIC_RELEASE);
+	}
+}
+
+static void chunk_unpin(struct chunk * c)
+{
+	__atomic_sub_fetch(&c->users, 1, __ATOMIC_RELEASE);
+}
+
+/* returns the fd of a pinned chunk, opening it if necessary */
+static int chunk_pin(struct chunk * c)
+{
+	int users = __atomic_load_n(&c->users, __ATOMIC_RELAXED);
+	int fd;
+
+	for (;;) {
+		if (users < 0) {
+			/* being evicted, wait for the hand to pass */
+			pthread_mutex_lock(&fd_pool_lock);
+			pthread_mutex_unlock(&fd_pool_lock);
+			users = __atomic_load_n(&c->users, __ATOMIC_RELAXED);
+		} else if (__atomic_compare_exchange_n(
+				   &c->users, &users, users + 1, 1,
+				   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	__atomic_store_n(&c->referenced, 1, __ATOMIC_RELAXED);
+
+	fd = __atomic_load_n(&c->fd, __ATOMIC_ACQUIRE);
+
+	if (fd >= 0) {
+		return fd;
+	}
+
+	fd = openat(src_fd, c->path, O_RDONLY);
+
+	if (fd < 0) {
+		fd = -errno;
+		chunk_unpin(c);
+		return fd;
+	}
+
+	pthread_mutex_lock(&fd_pool_lock);
+
+	if (c->fd >= 0) {
+		close(fd);
+		fd = c->fd;
+	} else {
+		__atomic_store_n(&c->fd, fd, __ATOMIC_RELEASE);
+		fd_pool_insert(c);
+		fd_pool_evict();
+	}
+
+	pthread_mutex_unlock(&fd_pool_lock);
+
+	return fd;
+}
+
+/*
+  With -o mmap chunks are mapped on their first read and copied from for
+  as long as their concat_file version lives, which saves a syscall per
+  chunk segment. A chunk that shrinks under its mapping raises SIGBUS on
+  the copy; the handler jumps back out and the read falls back to pread.
+*/
+
+static __thread sigjmp_buf * mmap_fault_jmp;
+
+static void mmap_fault_handler(int sig)
+{
+	if (mmap_fault_jmp) {
+		siglongjmp(*mmap_fault_jmp, 1);
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void mmap_fault_init()
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+
+	/* SA_NODEFER, so jumping out doesn't leave SIGBUS blocked */
+	sa.sa_handler = mmap_fault_handler;
+	sa.sa_flags = SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGBUS, &sa, NULL);
+}
+
+static int mmap_copy(void * dst, const void * src, size_t len)
+{
+	sigjmp_buf jmp;
+
+	if (sigsetjmp(jmp, 0)) {
+		mmap_fault_jmp = 0;
+		return -EIO;
+	}
+
+	mmap_fault_jmp = &jmp;
+	memcpy(dst, src, len);
+	mmap_fault_jmp = 0;
+
+	return 0;
+}
+
+/*
+  Mappings start at the page holding the chunk's offset, map_len counts
+  from there. Returns the chunk's first byte in the mapping.
+*/
+
+static off_t chunk_map_skew(struct chunk * c)
+{
+	return c->offset % sysconf(_SC_PAGESIZE);
+}
+
+static char * chunk_map(struct chunk * c)
+{
+	void * map = __atomic_load_n(&c->map, __ATOMIC_ACQUIRE);
+	off_t skew = chunk_map_skew(c);
+	off_t len;
+	int fd;
+
+	if (map) {
+		return map == MAP_FAILED ? 0 : (char *) map + skew;
+	}
+
+	fd = chunk_pin(c);
+
+	if (fd < 0) {
+		return 0;
+	}
+
+	len = skew + chunk_size(c);
+	map = mmap(0, len, PROT_READ, MAP_SHARED, fd, c->offset - skew);
+
+	chunk_unpin(c);
+
+	/* map_len is published by the release store of map */
+	pthread_mutex_lock(&fd_pool_lock);
+
+	if (!c->map) {
+		c->map_len = len;
+		__atomic_store_n(&c->map, map, __ATOMIC_RELEASE);
+	} else if (map != MAP_FAILED) {
+		munmap(map, len);
+	}
+
+	map = c->map;
+
+	pthread_mutex_unlock(&fd_pool_lock);
+
+	return map == MAP_FAILED ? 0 : (char *) map + skew;
+}
+
+/* loads a pattern chunk's file on its first read, published like map */
+static char * chunk_pattern(struct chunk * c)
+{
+	char * p = __atomic_load_n(&c->map, __ATOMIC_ACQUIRE);
+	struct stat stbuf;
+	off_t len = 0;
+	int fd;
+
+	if (p) {
+		return p == MAP_FAILED ? 0 : p;
+	}
+
+	fd = openat(src_fd, c->path, O_RDONLY);
+
+	if (fd >= 0 && fstat(fd, &stbuf) == 0 && stbuf.st_size > 0) {
+		p = (char *) malloc(stbuf.st_size);
+
+		while (len < stbuf.st_size) {
+			ssize_t r = pread(fd, p + len, stbuf.st_size - len, len);
+
+			if (r <= 0) {
+				break;
+			}
+			len += r;
+		}
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (!p || len == 0) {
+		free(p);
+		p = (char *) MAP_FAILED;
+	}
+
+	pthread_mutex_lock(&fd_pool_lock);
+
+	if (!c->map) {
+		c->map_len = len;
+		__atomic_store_n(&c->map, p, __ATOMIC_RELEASE);
+	} else if (p != MAP_FAILED) {
+		free(p);
+	}
+
+	p = (char *) c->map;
+
+	pthread_mutex_unlock(&fd_pool_lock);
+
+	return p == MAP_FAILED ? 0 : p;
+}
+
+/*
+  Decompressed zstd frames are kept in a cache shared by all chunks and
+  handles, up to zstd_cache MiB, and dropped least recently used first.
+  Frames still in use by a reader are freed when it puts them back.
+*/
+
+#define ZSTD_CACHE_HASH 4096
+
+struct zstd_frame {
+	struct zstd_frame * next;
+	struct zstd_frame * lru_prev;
+	struct zstd_frame * lru_next;
+
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	uint32_t frame;
+
+	int refs;
+	size_t len;
+	char data[];
+};
+
+static struct zstd_frame * zstd_frames[ZSTD_CACHE_HASH];
+static struct zstd_frame zstd_lru = {
+	.lru_prev = &zstd_lru,
+	.lru_next = &zstd_lru,
+};
+static size_t zstd_cached = 0;
+static pthread_mutex_t zstd_lock;
+
+#ifdef HAVE_ZSTD
+static pthread_key_t zstd_key;
+
+static void zstd_dctx_free(void * p)
+{
+	ZSTD_freeDCtx((ZSTD_DCtx *) p);
+}
+#endif
+
+static int zstd_decompress(void * dst, size_t dlen,
+			   const void * src, size_t clen)
+{
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx * dctx = (ZSTD_DCtx *) pthread_getspecific(zstd_key);
+	size_t rv;
+
+	if (!dctx) {
+		dctx = ZSTD_createDCtx();
+		pthread_setspecific(zstd_key, dctx);
+	}
+
+	rv = ZSTD_decompressDCtx(dctx, dst, dlen, src, clen);
+
+	return ZSTD_isError(rv) || rv != dlen ? -EIO : 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+static unsigned int zstd_frame_hash(const struct zstd_index * zi,
+				    uint32_t frame)
+{
+	uint64_t h = (uint64_t) zi->ino * 0x9E3779B97F4A7C15ULL
+		^ (uint64_t) zi->dev ^ ((uint64_t) frame << 20) ^ frame;
+
+	return (h ^ (h >> 29)) % ZSTD_CACHE_HASH;
+}
+
+/* called with zstd_lock held */
+static struct zstd_frame * zstd_frame_find(const struct zstd_index * zi,
+					   uint32_t frame, unsigned int h)
+{
+	struct zstd_frame * f;
+
+	for (f = zstd_frames[h]; f; f = f->next) {
+		if (f->frame == frame && f->ino == zi->ino && f->dev == zi->dev
+		    && f->size == zi->size
+		    && timespec_equal(&f->mtime, &zi->mtime)) {
+			return f;
+		}
+	}
+
+	return 0;
+}
+
+/* called with zstd_lock held */
+static void zstd_lru_unlink(struct zstd_frame * f)
+{
+	f->lru_prev->lru_next = f->lru_next;
+	f->lru_next->lru_prev = f->lru_prev;
+}
+
+/* called with zstd_lock held */
+static void zstd_lru_push(struct zstd_frame * f)
+{
+	f->lru_next = zstd_lru.lru_next;
+	f->lru_prev = &zstd_lru;
+	zstd_lru.lru_next->lru_prev = f;
+	zstd_lru.lru_next = f;
+}
+
+static void zstd_frame_put(struct zstd_frame * f)
+{
+	pthread_mutex_lock(&zstd_lock);
+
+	if (--f->refs == 0) {
+		free(f);
+	}
+
+	pthread_mutex_unlock(&zstd_lock);
+}
+
+/* drops f from the cache, called with zstd_lock held */
+static void zstd_frame_evict(struct zstd_frame * f)
+{
+	struct zstd_frame ** p = &zstd_frames[zstd_frame_hash(
+			&(struct zstd_index) { .dev = f->dev, .ino = f->ino },
+			f->frame)];
+
+	for (; *p; p = &(*p)->next) {
+		if (*p == f) {
+			*p = f->next;
+			break;
+		}
+	}
+
+	zstd_lru_unlink(f);
+	zstd_cached -= f->len;
+
+	if (--f->refs == 0) {
+		free(f);
+	}
+}
+
+/* returns frame i of c decompressed, with a reference held on it */
+static struct zstd_frame * zstd_frame_get(struct chunk * c,
+					  struct zstd_index * zi, uint32_t i)
+{
+	unsigned int h = zstd_frame_hash(zi, i);
+	size_t clen = zi->coff[i + 1] - zi->coff[i];
+	size_t cap = (size_t) options.zstd_cache << 20;
+	struct zstd_frame * f;
+	struct zstd_frame * o;
+	char * cbuf;
+	ssize_t n;
+	int fd;
+
+	pthread_mutex_lock(&zstd_lock);
+
+	if ((f = zstd_frame_find(zi, i, h))) {
+		f->refs++;
+		zstd_lru_unlink(f);
+		zstd_lru_push(f);
+	}
+
+	pthread_mutex_unlock(&zstd_lock);
+
+	if (f) {
+		stat_add(&thread_stats_get()->zstd_hits, 1);
+		return f;
+	}
+
+	f = (struct zstd_frame *) malloc(
+		sizeof(struct zstd_frame) + zi->doff[i + 1] - zi->doff[i]);
+
+	f->dev = zi->dev;
+	f->ino = zi->ino;
+	f->size = zi->size;
+	f->mtime = zi->mtime;
+	f->frame = i;
+	f->refs = 1;
+	f->len = zi->doff[i + 1] - zi->doff[i];
+
+	fd = chunk_pin(c);
+
+	if (fd < 0) {
+		free(f);
+		return 0;
+	}
+
+	cbuf = (char *) malloc(clen ? clen : 1);
+	n = pread(fd, cbuf, clen, zi->coff[i]);
+
+	chunk_unpin(c);
+
+	if (n != (ssize_t) clen
+	    || zstd_decompress(f->data, f->len, cbuf, clen) != 0) {
+		free(cbuf);
+		free(f);
+		return 0;
+	}
+
+	free(cbuf);
+
+	stat_add(&thread_stats_get()->zstd_frames, 1);
+
+	if (cap == 0) {
+		return f;
+	}
+
+	pthread_mutex_lock(&zstd_lock);
+
+	/* another reader was quicker */
+	if ((o = zstd_frame_find(zi, i, h))) {
+		o->refs++;
+		pthread_mutex_unlock(&zstd_lock);
+		free(f);
+		return o;
+	}
+
+	f->refs++;
+	f->next = zstd_frames[h];
+	zstd_frames[h] = f;
+	zstd_lru_push(f);
+	zstd_cached += f->len;
+
+	while (zstd_cached > cap && zstd_lru.lru_prev != f) {
+		zstd_frame_evict(zstd_lru.lru_prev);
+	}
+
+	pthread_mutex_unlock(&zstd_lock);
+
+	return f;
+}
+
+/* reads a zstd chunk's frame index on its first read, published like map */
+static struct zstd_index * chunk_zstd_index(struct chunk * c)
+{
+	void * p = __atomic_load_n(&c->map, __ATOMIC_ACQUIRE);
+	struct zstd_index * zi = 0;
+	int fd;
+
+	if (p) {
+		return p == MAP_FAILED ? 0 : (struct zstd_index *) p;
+	}
+
+	fd = chunk_pin(c);
+
+	if (fd >= 0) {
+		zi = zstd_index_read(fd);
+		chunk_unpin(c);
+	}
+
+	pthread_mutex_lock(&fd_pool_lock);
+
+	if (!c->map) {
+		__atomic_store_n(&c->map, zi ? (void *) zi : MAP_FAILED,
+				 __ATOMIC_RELEASE);
+	} else {
+		zstd_index_free(zi);
+	}
+
+	p = c->map;
+
+	pthread_mutex_unlock(&fd_pool_lock);
+
+	return p == MAP_FAILED ? 0 : (struct zstd_index *) p;
+}
+
+/* decompresses n bytes at coffset of a zstd chunk */
+static ssize_t chunk_zstd_read(struct chunk * c, char * buf, size_t n,
+			       off_t coffset)
+{
+	struct zstd_index * zi = chunk_zstd_index(c);
+	uint64_t pos = c->offset + coffset;
+	size_t done = 0;
+	uint32_t lo = 0;
+	uint32_t hi;
+
+	if (!zi) {
+		return -EIO;
+	}
+
+	/* the last frame starting at or before pos */
+	for (hi = zi->nframes; hi - lo > 1; ) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (zi->doff[mid] <= pos) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (; done < n && lo < zi->nframes; lo++) {
+		struct zstd_frame * f;
+		size_t k;
+
+		if (zi->doff[lo + 1] <= pos) {
+			continue;
+		}
+
+		if (!(f = zstd_frame_get(c, zi, lo))) {
+			return done ? (ssize_t) done : -EIO;
+		}
+
+		k = zi->doff[lo + 1] - pos;
+
+		if (k > n - done) {
+			k = n - done;
+		}
+
+		memcpy(buf + done, f->data + (pos - zi->doff[lo]), k);
+		zstd_frame_put(f);
+
+		done += k;
+		pos += k;
+	}
+
+	return done;
+}
+
+/*
+  A remote read is cut into parts, each a range GET of its own. With a
+  disk cache the parts are whole REMOTE_PART blocks, which are stored in
+  the cache file and copied out of; blocks the cache has are read from
+  it instead.
+*/
+
+struct remote_part {
+	struct task task;
+	struct remote * r;
+	unsigned int version;
+	int cache_fd;
+
+	/* what gets fetched, whole blocks go through block first */
+	off_t offset;
+	size_t len;
+	int whole;
+	char * block;
+
+	/* what is wanted of it, rv is the bytes copied to dst or -errno */
+	char * dst;
+	off_t from;
+	size_t n;
+	ssize_t rv;
+};
+
+static void remote_part_copy(struct remote_part * p, ssize_t got)
+{
+	off_t skip = p->from - p->offset;
+
+	if (got < 0) {
+		p->rv = got;
+		return;
+	}
+
+	p->rv = got > skip ? got - skip : 0;
+
+	if ((size_t) p->rv > p->n) {
+		p->rv = p->n;
+	}
+
+	memcpy(p->dst, p->block + skip, p->rv);
+}
+
+static void remote_part_run(struct task * t)
+{
+	struct remote_part * p = (struct remote_part *) t;
+	ssize_t got;
+
+	if (!p->whole) {
+		p->rv = remote_fetch(p->r, p->dst, p->len, p->offset);
+		return;
+	}
+
+	p->block = (char *) malloc(p->len);
+	got = remote_fetch(p->r, p->block, p->len, p->offset);
+
+	pthread_rwlock_rdlock(&p->r->cache_lock);
+
+	/* blocks of an older version stay out of the new version's file */
+	if (got >= 0 && (size_t) got == p->len && p->r->version == p->version
+	    && pwrite(p->cache_fd, p->block, p->len, p->offset) != got) {
+		/* a partial block mustn't look cached */
+		fallocate(p->cache_fd, FALLOC_FL_PUNCH_HOLE
+			  | FALLOC_FL_KEEP_SIZE, p->offset, p->len);
+	}
+
+	pthread_rwlock_unlock(&p->r->cache_lock);
+
+	remote_part_copy(p, got);
+
+	free(p->block);
+}
+
+/* returns 1 if block [offset, offset + len) is in the cache file */
+static int remote_cached(int fd, off_t offset, size_t len)
+{
+	return lseek(fd, offset, SEEK_DATA) == offset
+		&& lseek(fd, offset, SEEK_HOLE) >= offset + (off_t) len;
+}
+
+static struct remote * chunk_remote(struct chunk * c)
+{
+	struct remote * r = __atomic_load_n(&c->map, __ATOMIC_ACQUIRE);
+
+	if (!r) {
+		r = remote_lookup(c->path);
+		__atomic_store_n(&c->map, r, __ATOMIC_RELEASE);
+	}
+
+	return r;
+}
+
+/* reads n bytes at coffset of a remote chunk */
+static ssize_t chunk_remote_read(struct chunk * c, char * buf, size_t n,
+				 off_t coffset)
+{
+	struct remote * r = chunk_remote(c);
+	struct remote_part * parts;
+	struct task_group g;
+	off_t pos = c->offset + coffset;
+	off_t end = pos + n;
+	off_t size;
+	ssize_t rv = 0;
+	size_t nparts = 0;
+	size_t i;
+	int fd;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&r->cache_lock);
+
+	fd = remote_cache_fd(r);
+	size = r->size;
+
+	parts = (struct remote_part *) calloc(
+		sizeof(struct remote_part), n / REMOTE_PART + 2);
+
+	/* a cached object that shrank reads short */
+	while (pos < end && (fd < 0 || pos < size)) {
+		struct remote_part * p = &parts[nparts++];
+
+		p->r = r;
+		p->version = r->version;
+		p->cache_fd = fd;
+		p->dst = buf;
+		p->from = pos;
+
+		if (fd < 0) {
+			p->offset = pos;
+			p->len = end - pos < REMOTE_PART
+				? end - pos : REMOTE_PART;
+		} else {
+			p->offset = pos - pos % REMOTE_PART;
+			p->len = size - p->offset < REMOTE_PART
+				? size - p->offset : REMOTE_PART;
+			p->whole = 1;
+		}
+
+		p->n = p->offset + (off_t) p->len - pos < end - pos
+			? p->offset + p->len - pos : end - pos;
+
+		/* parts the cache has are done right away */
+		if (fd >= 0 && remote_cached(fd, p->offset, p->len)) {
+			ssize_t got = pread(fd, buf, p->n, pos);
+
+			p->rv = got < 0 ? -errno : got;
+			p->offset = -1;
+			stat_add(&thread_stats_get()->remote_cache_hits, 1);
+		}
+
+		buf += p->n;
+		pos += p->n;
+	}
+
+	pthread_rwlock_unlock(&r->cache_lock);
+
+	task_group_init(&g, &io_pool);
+
+	for (i = 0; i < nparts; i++) {
+		if (parts[i].offset < 0) {
+			continue;
+		}
+		parts[i].task.fn = remote_part_run;
+		task_submit(&g, &parts[i].task);
+	}
+
+	task_group_wait(&g);
+	task_group_destroy(&g);
+
+	for (i = 0; i < nparts; i++) {
+		if (parts[i].rv < 0) {
+			if (rv == 0) {
+				rv = parts[i].rv;
+			}
+			break;
+		}
+
+		rv += parts[i].rv;
+
+		if ((size_t) parts[i].rv < parts[i].n) {
+			break;
+		}
+	}
+
+	free(parts);
+
+	return rv;
+}
+
+static ssize_t chunk_zero_read(struct chunk * c, char * buf, size_t n,
+			       off_t coffset)
+{
+	memset(buf, 0, n);
+
+	return n;
+}
+
+static ssize_t chunk_pattern_read(struct chunk * c, char * buf, size_t n,
+				  off_t coffset)
+{
+	char * p;
+	off_t at;
+	size_t done;
+
+	if (!(p = chunk_pattern(c))) {
+		return -EIO;
+	}
+
+	at = (c->offset + coffset) % c->map_len;
+
+	for (done = 0; done < n; at = 0) {
+		size_t k = c->map_len - at;
+
+		if (k > n - done) {
+			k = n - done;
+		}
+
+		memcpy(buf + done, p + at, k);
+		done += k;
+	}
+
+	return n;
+}
+
+static void chunk_unmap(struct chunk * c)
+{
+	munmap(c->map, c->map_len);
+}
+
+static void chunk_pattern_release(struct chunk * c)
+{
+	free(c->map);
+}
+
+static void chunk_zstd_release(struct chunk * c)
+{
+	zstd_index_free((struct zstd_index *) c->map);
+}
+
+/*
+  Every chunk kind has a backend: read makes up or fetches n bytes at
+  coffset of chunks that aren't read from a local file as they are,
+  release frees what the backend keeps in map. File chunks are read
+  with pread(), splice or their mapping instead.
+*/
+
+struct chunk_backend {
+	ssize_t (*read)(struct chunk * c, char * buf, size_t n,
+			off_t coffset);
+	void (*release)(struct chunk * c);
+};
+
+static const struct chunk_backend chunk_backends[] = {
+	[CHUNK_FILE] = { 0, chunk_unmap },
+	[CHUNK_ZERO] = { chunk_zero_read, 0 },
+	[CHUNK_PATTERN] = { chunk_pattern_read, chunk_pattern_release },
+	[CHUNK_ZSTD] = { chunk_zstd_read, chunk_zstd_release },
+	[CHUNK_REMOTE] = { chunk_remote_read, 0 },
+};
+
+/* makes up n bytes at coffset of a chunk that isn't read as is */
+static ssize_t chunk_fill(struct chunk * c, char * buf, size_t n,
+			  off_t coffset)
+{
+	return chunk_backends[c->kind].read(c, buf, n, coffset);
+}
+
+/* reads n bytes at coffset of c, from its mapping with -o mmap */
+static ssize_t chunk_pread(struct chunk * c, void * buf, size_t n,
+			   off_t coffset)
+{
+	uint64_t start;
+	ssize_t rv;
+	int fd;
+
+	if (c->kind != CHUNK_FILE) {
+		return chunk_fill(c, (char *) buf, n, coffset);
+	}
+
+	if (options.use_mmap) {
+		char * map = chunk_map(c);
+
+		/* appends may have grown the chunk past its mapping */
+		if (map && chunk_map_skew(c) + coffset + (off_t) n <= c->map_len
+		    && mmap_copy(buf, map + coffset, n) == 0) {
+			return n;
+		}
+	}
+
+	fd = chunk_pin(c);
+
+	if (fd < 0) {
+		return fd;
+	}
+
+	start = now_ns();
+	rv = pread(fd, buf, n, c->offset + coffset);
+
+	if (rv < 0) {
+		rv = -errno;
+	} else {
+		stats_count(STAT_CHUNK_PREAD, start);
+	}
+
+	chunk_unpin(c);
+
+	return rv;
+}
+
+/*
+  With -o block_cache, random reads of file chunks go through a cache of
+  64 KiB blocks shared by all handles, keyed by the chunk file's identity
+  and block index, so regions many clients probe (indexes at the head
+  and tail of media files) are read from the file only once.
+  The cache is split into shards with a lock each, every shard evicts by
+  CLOCK. Sequential readers bypass it and keep splicing.
+
+  A chunk's identity is taken from its fd on the first cached read.
+  Blocks remember the file's mtime at that point, so chunks of a newer
+  manifest version don't see blocks of a file that changed since; writes
+  through concatfs drop the blocks they touch.
+*/
+
+#define CACHE_BLOCK_SIZE (64 << 10)
+#define BLOCK_SHARDS 64
+
+struct cached_block {
+	struct cached_block * next;
+
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	off_t index;
+
+	int referenced;
+	size_t len;
+	char * data;
+};
+
+struct block_shard {
+	pthread_mutex_t lock;
+	struct cached_block * slots;
+	struct cached_block ** hash;
+	size_t nslots;
+	size_t hand;
+
+	/* counts drops, fills that raced with one aren't kept */
+	uint64_t drops;
+};
+
+static struct block_shard * block_shards = 0;
+static size_t block_nshards = 0;
+
+/* sizes the shards for -o block_cache MiB */
+static void block_cache_init(unsigned int mib)
+{
+	size_t nblocks = ((size_t) mib << 20) / CACHE_BLOCK_SIZE;
+	size_t i;
+
+	if (nblocks == 0) {
+		return;
+	}
+
+	for (block_nshards = BLOCK_SHARDS; block_nshards > nblocks;
+	     block_nshards /= 2) {
+	}
+
+	block_shards = (struct block_shard *) calloc(
+		sizeof(struct block_shard), block_nshards);
+
+	for (i = 0; i < block_nshards; i++) {
+		struct block_shard * s = &block_shards[i];
+
+		pthread_mutex_init(&s->lock, NULL);
+		s->nslots = nblocks / block_nshards;
+		s->slots = (struct cached_block *) calloc(
+			sizeof(struct cached_block), s->nslots);
+		s->hash = (struct cached_block **) calloc(
+			sizeof(struct cached_block *), s->nslots);
+	}
+}
+
+static uint64_t block_hash(dev_t dev, ino_t ino, off_t index)
+{
+	uint64_t h = ((uint64_t) ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) dev;
+
+	h ^= (uint64_t) index * 0xC2B2AE3D27D4EB4FULL;
+
+	return h ^ (h >> 31);
+}
+
+static struct block_shard * block_shard_of(uint64_t h)
+{
+	return &block_shards[h % block_nshards];
+}
+
+/* called with the shard's lock held */
+static struct cached_block ** block_slot(struct block_shard * s, uint64_t h,
+					 dev_t dev, ino_t ino, off_t index)
+{
+	struct cached_block ** p = &s->hash[(h / block_nshards) % s->nslots];
+
+	for (; *p; p = &(*p)->next) {
+		if ((*p)->index == index && (*p)->ino == ino
+		    && (*p)->dev == dev) {
+			break;
+		}
+	}
+
+	return p;
+}
+
+/* called with the shard's lock held */
+static void block_unhash(struct block_shard * s, struct cached_block * b)
+{
+	uint64_t h = block_hash(b->dev, b->ino, b->index);
+	struct cached_block ** p = block_slot(s, h, b->dev, b->ino, b->index);
+
+	if (*p == b) {
+		*p = b->next;
+	}
+
+	free(b->data);
+	b->data = 0;
+}
+
+/* called with the shard's lock held */
+static struct cached_block * block_victim(struct block_shard * s)
+{
+	for (;;) {
+		struct cached_block * b = &s->slots[s->hand];
+
+		s->hand = (s->hand + 1) % s->nslots;
+
+		if (!b->data) {
+			return b;
+		}
+		if (!b->referenced) {
+			block_unhash(s, b);
+			return b;
+		}
+
+		b->referenced = 0;
+	}
+}
+
+/* drops the cached blocks of file bytes [offset, offset + len) */
+static void block_cache_drop(dev_t dev, ino_t ino, off_t offset, off_t len)
+{
+	off_t index;
+
+	if (!block_nshards || len <= 0) {
+		return;
+	}
+
+	for (index = offset / CACHE_BLOCK_SIZE;
+	     index <= (offset + len - 1) / CACHE_BLOCK_SIZE; index++) {
+		uint64_t h = block_hash(dev, ino, index);
+		struct block_shard * s = block_shard_of(h);
+		struct cached_block * b;
+
+		pthread_mutex_lock(&s->lock);
+
+		if ((b = *block_slot(s, h, dev, ino, index))) {
+			block_unhash(s, b);
+		}
+		__atomic_add_fetch(&s->drops, 1, __ATOMIC_RELEASE);
+
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/* copies from block index of c, returns -1 if it's not cached as needed */
+static ssize_t block_copy(struct chunk * c, off_t index, size_t in,
+			  char * buf, size_t n)
+{
+	uint64_t h = block_hash(c->dev, c->ino, index);
+	struct block_shard * s = block_shard_of(h);
+	struct cached_block * b;
+	ssize_t rv = -1;
+
+	pthread_mutex_lock(&s->lock);
+
+	b = *block_slot(s, h, c->dev, c->ino, index);
+
+	/* a short block may have grown since */
+	if (b && timespec_equal(&b->mtime, &c->mtime)
+	    && (b->len == CACHE_BLOCK_SIZE || in + n <= b->len)) {
+		rv = in < b->len ? (b->len - in < n ? b->len - in : n) : 0;
+		memcpy(buf, b->data + in, rv);
+		b->referenced = 1;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return rv;
+}
+
+/* reads block index of c from its file into the cache, copies from it */
+static ssize_t block_fill(struct chunk * c, off_t index, size_t in,
+			  char * buf, size_t n)
+{
+	uint64_t h = block_hash(c->dev, c->ino, index);
+	struct block_shard * s = block_shard_of(h);
+	struct cached_block * b;
+	char * data = (char *) malloc(CACHE_BLOCK_SIZE);
+	uint64_t drops = __atomic_load_n(&s->drops, __ATOMIC_ACQUIRE);
+	uint64_t start;
+	ssize_t len;
+	ssize_t rv;
+	int fd = chunk_pin(c);
+
+	if (fd < 0) {
+		free(data);
+		return fd;
+	}
+
+	start = now_ns();
+	len = pread(fd, data, CACHE_BLOCK_SIZE, index * CACHE_BLOCK_SIZE);
+
+	if (len < 0) {
+		len = -errno;
+	} else {
+		stats_count(STAT_CHUNK_PREAD, start);
+	}
+
+	chunk_unpin(c);
+
+	if (len < 0) {
+		free(data);
+		return len;
+	}
+
+	rv = (size_t) len > in ? ((size_t) len - in < n ? len - in : n) : 0;
+	memcpy(buf, data + in, rv);
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->drops != drops) {
+		pthread_mutex_unlock(&s->lock);
+		free(data);
+		return rv;
+	}
+
+	/* another reader may have been quicker, this one is as new */
+	if ((b = *block_slot(s, h, c->dev, c->ino, index))) {
+		block_unhash(s, b);
+	}
+
+	b = block_victim(s);
+
+	b->dev = c->dev;
+	b->ino = c->ino;
+	b->mtime = c->mtime;
+	b->index = index;
+	b->referenced = 0;
+	b->len = len;
+	b->data = data;
+	b->next = s->hash[(h / block_nshards) % s->nslots];
+	s->hash[(h / block_nshards) % s->nslots] = b;
+
+	pthread_mutex_unlock(&s->lock);
+
+	return rv;
+}
+
+/* takes the identity of c's file from its fd, once */
+static int chunk_ident(struct chunk * c)
+{
+	struct stat st;
+	int fd;
+
+	if (__atomic_load_n(&c->ident, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	if ((fd = chunk_pin(c)) < 0) {
+		return fd;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		chunk_unpin(c);
+		return -errno;
+	}
+
+	chunk_unpin(c);
+
+	pthread_mutex_lock(&fd_pool_lock);
+
+	if (!c->ident) {
+		c->dev = st.st_dev;
+		c->ino = st.st_ino;
+		c->mtime = st.st_mtim;
+		__atomic_store_n(&c->ident, 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&fd_pool_lock);
+
+	return 0;
+}
+
+/* chunk_pread through the block cache */
+static ssize_t chunk_cached_read(struct chunk * c, char * buf, size_t n,
+				 off_t coffset)
+{
+	struct thread_stats * ts;
+	size_t done = 0;
+	int rv;
+
+	if (c->kind != CHUNK_FILE || options.use_mmap
+	    || (rv = chunk_ident(c)) < 0) {
+		return chunk_pread(c, buf, n, coffset);
+	}
+
+	ts = thread_stats_get();
+
+	while (done < n) {
+		off_t pos = c->offset + coffset + done;
+		size_t in = pos % CACHE_BLOCK_SIZE;
+		off_t index = pos / CACHE_BLOCK_SIZE;
+		size_t k = CACHE_BLOCK_SIZE - in;
+		ssize_t got;
+
+		if (k > n - done) {
+			k = n - done;
+		}
+
+		if ((got = block_copy(c, index, in, buf + done, k)) >= 0) {
+			stat_add(&ts->block_hits, 1);
+		} else {
+			stat_add(&ts->block_misses, 1);
+			got = block_fill(c, index, in, buf + done, k);
+		}
+
+		if (got < 0) {
+			return done ? (ssize_t) done : got;
+		}
+
+		done += got;
+
+		if ((size_t) got < k) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+static struct concat_file * concat_file_new(struct manifest * m)
+{
+	struct concat_file * rv;
+	off_t start = 0;
+	size_t i;
+
+	rv = (struct concat_file *) calloc(sizeof(struct concat_file), 1);
+
+	rv->m = m;
+	rv->fsize = m->fsize;
+	rv->refcount = 1;
+	rv->created = now_ns();
+	rv->nchunks = m->nchunks;
+	rv->chunks = (struct chunk *) calloc(sizeof(struct chunk), m->nchunks);
+
+	for (i = 0; i < m->nchunks; i++) {
+		struct chunk * c = &rv->chunks[i];
+
+		c->path = m->chunks[i].path;
+		c->fd = -1;
+		c->start = start;
+		c->fsize = m->chunks[i].fsize;
+		c->offset = m->chunks[i].offset;
+		c->slice = m->chunks[i].slice;
+		c->kind = m->chunks[i].kind;
+
+		start += c->fsize;
+	}
+
+	return rv;
+}
+
+static void concat_file_free(struct concat_file * cf)
+{
+	size_t i;
+
+	pthread_mutex_lock(&fd_pool_lock);
+
+	for (i = 0; i < cf->nchunks; i++) {
+		struct chunk * c = &cf->chunks[i];
+
+		if (c->fd >= 0) {
+			fd_pool_unlink(c);
+			close(c->fd);
+		}
+		if (c->map && c->map != MAP_FAILED
+		    && chunk_backends[c->kind].release) {
+			chunk_backends[c->kind].release(c);
+		}
+	}
+
+	pthread_mutex_unlock(&fd_pool_lock);
+
+	manifest_put(cf->m);
+
+	free(cf->chunks);
+	free(cf);
+}
+
+static void concat_file_unref(struct concat_file * cf)
+{
+	if (__atomic_sub_fetch(&cf->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&manifest_lock);
+	if (cf->m->cf == cf) {
+		cf->m->cf = 0;
+	}
+	pthread_mutex_unlock(&manifest_lock);
+
+	concat_file_free(cf);
+}
+
+/* called with manifest_lock held, fails on a concat_file being freed */
+static int concat_file_ref(struct concat_file * cf)
+{
+	int refcount = __atomic_load_n(&cf->refcount, __ATOMIC_RELAXED);
+
+	while (refcount > 0) {
+		if (__atomic_compare_exchange_n(
+			    &cf->refcount, &refcount, refcount + 1, 1,
+			    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+  The fds handed out by read_buf_concat_file are only used when the reply
+  is spliced from them, so their pins are kept per thread until the read
+  handler has sent it, or at the latest until that thread's next read.
+*/
+
+struct chunk_pin {
+	struct concat_file * cf;
+	struct chunk * c;
+};
+
+struct deferred_pins {
+	struct chunk_pin * pins;
+	size_t npins;
+	size_t alloced;
+};
+
+static pthread_key_t deferred_pins_key;
+
+static void deferred_pins_release(struct deferred_pins * d)
+{
+	size_t i;
+
+	for (i = 0; i < d->npins; i++) {
+		chunk_unpin(d->pins[i].c);
+		concat_file_unref(d->pins[i].cf);
+	}
+
+	d->npins = 0;
+}
+
+static void deferred_pins_free(void * p)
+{
+	struct deferred_pins * d = (struct deferred_pins *) p;
+
+	deferred_pins_release(d);
+
+	free(d->pins);
+	free(d);
+}
+
+static struct deferred_pins * deferred_pins_get()
+{
+	struct deferred_pins * d = pthread_getspecific(deferred_pins_key);
+
+	if (!d) {
+		d = (struct deferred_pins *) calloc(
+			sizeof(struct deferred_pins), 1);
+		pthread_setspecific(deferred_pins_key, d);
+	}
+
+	return d;
+}
+
+static void deferred_pins_add(struct deferred_pins * d,
+			      struct concat_file * cf, struct chunk * c)
+{
+	if (d->npins == d->alloced) {
+		d->alloced = d->alloced ? d->alloced * 2 : 16;
+		d->pins = (struct chunk_pin *) realloc(
+			d->pins, d->alloced * sizeof(struct chunk_pin));
+	}
+
+	__atomic_add_fetch(&cf->refcount, 1, __ATOMIC_RELAXED);
+
+	d->pins[d->npins].cf = cf;
+	d->pins[d->npins].c = c;
+	d->npins++;
+}
+
+/* returns a referenced concat_file for m, consuming the reference on m */
+static struct concat_file * concat_file_get(struct manifest * m)
+{
+	struct concat_file * cf;
+
+	pthread_mutex_lock(&manifest_lock);
+	cf = m->cf;
+	if (cf && !concat_file_ref(cf)) {
+		cf = 0;
+	}
+	pthread_mutex_unlock(&manifest_lock);
+
+	if (cf) {
+		manifest_put(m);
+	} else {
+		struct concat_file * n = concat_file_new(m);
+
+		pthread_mutex_lock(&manifest_lock);
+		cf = m->cf;
+		if (cf && concat_file_ref(cf)) {
+			pthread_mutex_unlock(&manifest_lock);
+			concat_file_free(n);
+		} else {
+			cf = m->cf = n;
+			pthread_mutex_unlock(&manifest_lock);
+		}
+	}
+
+	return cf;
+}
+
+/*
+  Opens the concat file of manifest m on top of its already opened fd,
+  consuming the reference on m. Only the first open of a manifest version
+  sets up the chunks; later ones share them.
+*/
+
+static struct concat_handle * open_concat_file(int fd, struct manifest * m,
+					       int * keep_cache)
+{
+	struct concat_handle * rv;
+
+	if (!m) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&manifest_lock);
+	*keep_cache = m->opened;
+	m->opened = 1;
+	pthread_mutex_unlock(&manifest_lock);
+
+	rv = (struct concat_handle *) calloc(sizeof(struct concat_handle), 1);
+
+	rv->cf = concat_file_get(m);
+	rv->fd = fd;
+	rv->wfd = -1;
+	pthread_mutex_init(&rv->write_lock, NULL);
+
+	return rv;
+}
+
+static void close_concat_file(struct concat_handle * h)
+{
+	size_t i;
+
+	if (!h) {
+		return;
+	}
+
+	concat_file_unref(h->cf);
+
+	for (i = 0; i < h->nretired; i++) {
+		concat_file_unref(h->retired[i]);
+	}
+
+	if (h->wfd >= 0) {
+		close(h->wfd);
+	}
+
+	close(h->fd);
+
+	pthread_mutex_destroy(&h->write_lock);
+	free(h->retired);
+	free(h);
+}
+
+/*
+  Presents the concatenation like a regular file: size and blocks of the
+  whole chunk set and the newest mtime of the manifest and its chunks.
+  st_ino stays the manifest's, so it's stable across chunk changes.
+  Consumes the reference on m.
+*/
+
+static void concat_attr(struct manifest * m, struct stat * stbuf)
+{
+	if (!m) {
+		stbuf->st_size = 0;
+		stbuf->st_blocks = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&manifest_lock);
+
+	stbuf->st_size = m->fsize;
+	stbuf->st_blocks = (m->fsize + 511) / 512;
+	stbuf->st_mtim = m->newest;
+
+	if (timespec_cmp(&stbuf->st_ctim, &m->newest) < 0) {
+		stbuf->st_ctim = m->newest;
+	}
+
+	manifest_unref(m);
+
+	pthread_mutex_unlock(&manifest_lock);
+}
+
+/*
+  Returns a referenced manifest for the concat file of n at path. The
+  one n used last is taken without a cache lookup as long as it's still
+  current for st, a fresh stat of the manifest, and not due for a
+  re-stat of its chunks.
+*/
+
+static struct manifest * node_manifest(struct node * n, const char * path,
+				       const struct stat * st)
+{
+	struct manifest * m;
+	struct manifest * old;
+
+	pthread_mutex_lock(&manifest_lock);
+
+	m = n->m;
+
+	if (m && m->cached && st && S_ISREG(st->st_mode)
+	    && manifest_matches(m, st)
+	    && (m->watched == 2 || now_seconds() - m->validated
+		< (time_t) options.chunk_ttl)) {
+		m->refcount++;
+		pthread_mutex_unlock(&manifest_lock);
+
+		stat_add(&thread_stats_get()->manifest_hits, 1);
+		return m;
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	m = manifest_get(path, st);
+
+	if (!m) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&manifest_lock);
+
+	m->refcount++;
+	old = n->m;
+	n->m = m;
+
+	if (old) {
+		manifest_unref(old);
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	return m;
+}
+
+/* fills in the concat file attributes of n if it is one */
+static void node_attr(struct node * n, const char * path, struct stat * st)
+{
+	if (n->concat && S_ISREG(st->st_mode)) {
+		concat_attr(node_manifest(n, path, st), st);
+	}
+}
+
+static int chunk_contains(struct chunk * c, off_t offset)
+{
+	return offset >= c->start && offset - c->start < chunk_size(c);
+}
+
+/* returns the index of the chunk holding offset, offset < cf->fsize */
+static size_t find_chunk(struct concat_file * cf, size_t hint, off_t offset)
+{
+	size_t lo = 0;
+	size_t hi = cf->nchunks;
+
+	if (hint < cf->nchunks && chunk_contains(&cf->chunks[hint], offset)) {
+		return hint;
+	}
+	if (hint + 1 < cf->nchunks
+	    && chunk_contains(&cf->chunks[hint + 1], offset)) {
+		return hint + 1;
+	}
+
+	/* last chunk starting at or before offset, skips empty chunks */
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cf->chunks[mid].start <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/*
+  The kernel's readahead on a chunk stops at the chunk's end, so the
+  first read of the next chunk would be a cold seek. Once a handle reads
+  sequentially, the next prefetch MiB behind the current chunk are
+  handed to a background thread, which opens those chunks and issues
+  POSIX_FADV_WILLNEED on them.
+
+  Concurrent kernel readahead requests may arrive slightly out of order,
+  so reads within PREFETCH_SLACK of the last one still count as
+  sequential.
+*/
+
+#define PREFETCH_QUEUE_SIZE 256
+#define PREFETCH_SLACK (1 << 20)
+
+struct prefetch_req {
+	struct concat_file * cf;
+	size_t chunk;
+	off_t offset;
+	off_t len;
+};
+
+static struct prefetch_req prefetch_queue[PREFETCH_QUEUE_SIZE];
+static unsigned int prefetch_head = 0;
+static unsigned int prefetch_tail = 0;
+static pthread_mutex_t prefetch_lock;
+static pthread_cond_t prefetch_cond;
+
+static void * prefetch_worker(void * arg)
+{
+	for (;;) {
+		struct prefetch_req req;
+		struct chunk * c;
+		int fd;
+
+		pthread_mutex_lock(&prefetch_lock);
+		while (prefetch_head == prefetch_tail) {
+			pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+		}
+		req = prefetch_queue[prefetch_tail++ % PREFETCH_QUEUE_SIZE];
+		pthread_mutex_unlock(&prefetch_lock);
+
+		c = &req.cf->chunks[req.chunk];
+
+		fd = chunk_pin(c);
+
+		if (fd >= 0) {
+			posix_fadvise(fd, c->offset + req.offset, req.len,
+				      POSIX_FADV_WILLNEED);
+			chunk_unpin(c);
+		}
+
+		concat_file_unref(req.cf);
+	}
+
+	return 0;
+}
+
+/* returns 0 if the queue is full */
+static int prefetch_queue_push(struct concat_file * cf, size_t chunk,
+			       off_t offset, off_t len)
+{
+	struct prefetch_req * req;
+
+	pthread_mutex_lock(&prefetch_lock);
+
+	if (prefetch_head - prefetch_tail == PREFETCH_QUEUE_SIZE) {
+		pthread_mutex_unlock(&prefetch_lock);
+		return 0;
+	}
+
+	__atomic_add_fetch(&cf->refcount, 1, __ATOMIC_RELAXED);
+
+	req = &prefetch_queue[prefetch_head++ % PREFETCH_QUEUE_SIZE];
+	req->cf = cf;
+	req->chunk = chunk;
+	req->offset = offset;
+	req->len = len;
+
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_lock);
+
+	return 1;
+}
+
+static void prefetch_after_read(struct concat_handle * h,
+				off_t offset, size_t count)
+{
+	struct concat_file * cf = handle_file(h);
+	off_t window = (off_t) options.prefetch << 20;
+	off_t next = __atomic_load_n(&h->next_offset, __ATOMIC_RELAXED);
+	off_t end = offset + count;
+	unsigned int sequential = 0;
+	off_t target;
+	off_t from;
+	size_t i;
+
+	if (count == 0) {
+		return;
+	}
+
+	if (offset + PREFETCH_SLACK >= next && offset <= next + PREFETCH_SLACK) {
+		sequential = __atomic_load_n(&h->sequential,
+					     __ATOMIC_RELAXED) + 1;
+	}
+
+	__atomic_store_n(&h->next_offset, end, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sequential, sequential, __ATOMIC_RELAXED);
+
+	if (sequential < 2) {
+		__atomic_store_n(&h->prefetched, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (window == 0) {
+		return;
+	}
+
+	/* the kernel reads ahead within the chunk the read ended in */
+	i = find_chunk(cf, __atomic_load_n(&h->hint, __ATOMIC_RELAXED),
+		       end - 1);
+	from = cf->chunks[i].start + chunk_size(&cf->chunks[i]);
+
+	if (from < __atomic_load_n(&h->prefetched, __ATOMIC_RELAXED)) {
+		from = __atomic_load_n(&h->prefetched, __ATOMIC_RELAXED);
+	}
+
+	target = end + window;
+
+	if (target > concat_size(cf)) {
+		target = concat_size(cf);
+	}
+
+	for (i++; i < cf->nchunks && from < target; i++) {
+		struct chunk * c = &cf->chunks[i];
+		off_t cend = c->start + chunk_size(c);
+
+		if (cend <= from) {
+			continue;
+		}
+		if (cend > target) {
+			cend = target;
+		}
+
+		if (c->kind != CHUNK_FILE) {
+			from = cend;
+			continue;
+		}
+
+		if (!prefetch_queue_push(cf, i, from - c->start, cend - from)) {
+			break;
+		}
+
+		from = cend;
+	}
+
+	__atomic_store_n(&h->prefetched, from, __ATOMIC_RELAXED);
+}
+
+/* accounts a finished read of count bytes at offset */
+static void concat_read_done(struct concat_handle * h,
+			     off_t offset, size_t count)
+{
+	__atomic_add_fetch(&handle_file(h)->bytes_read, count,
+			   __ATOMIC_RELAXED);
+
+	prefetch_after_read(h, offset, count);
+}
+
+/*
+  Reads spanning several chunks can issue all of their per-chunk reads
+  at once (-o io=pool or io=uring) instead of one after another. io=uring
+  batches them in a per-thread io_uring and falls back to the task pool
+  where the kernel doesn't allow io_uring.
+*/
+
+struct chunk_read {
+	struct task task;
+	struct chunk * c;
+
+	void * buf;
+	size_t len;
+	off_t offset;
+	ssize_t rv;
+};
+
+static void chunk_read_run(struct task * t)
+{
+	struct chunk_read * r = (struct chunk_read *) t;
+	uint64_t start;
+	int fd;
+
+	/* filled in memory already */
+	if (!r->c) {
+		return;
+	}
+
+	fd = chunk_pin(r->c);
+
+	if (fd < 0) {
+		r->rv = fd;
+		return;
+	}
+
+	start = now_ns();
+	r->rv = pread(fd, r->buf, r->len, r->offset);
+
+	if (r->rv < 0) {
+		r->rv = -errno;
+	}
+
+	stats_count(STAT_CHUNK_PREAD, start);
+
+	chunk_unpin(r->c);
+}
+
+static void chunk_reads_pool(struct chunk_read * r, size_t n)
+{
+	struct task_group g;
+	size_t i;
+
+	task_group_init(&g, &io_pool);
+
+	for (i = 1; i < n; i++) {
+		r[i].task.fn = chunk_read_run;
+		task_submit(&g, &r[i].task);
+	}
+
+	chunk_read_run(&r[0].task);
+
+	task_group_wait(&g);
+	task_group_destroy(&g);
+}
+
+#define URING_ENTRIES 64
+
+struct uring {
+	int fd;
+
+	unsigned int * sq_tail;
+	unsigned int * sq_mask;
+	unsigned int * sq_array;
+	struct io_uring_sqe * sqes;
+
+	unsigned int * cq_head;
+	unsigned int * cq_tail;
+	unsigned int * cq_mask;
+	struct io_uring_cqe * cqes;
+
+	void * sq_ptr;
+	void * cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+};
+
+static pthread_key_t uring_key;
+static int uring_broken = 0;
+
+static void uring_free(void * p)
+{
+	struct uring * u = (struct uring *) p;
+
+	munmap(u->sqes, u->sqes_len);
+	if (u->cq_ptr != u->sq_ptr) {
+		munmap(u->cq_ptr, u->cq_len);
+	}
+	munmap(u->sq_ptr, u->sq_len);
+	close(u->fd);
+	free(u);
+}
+
+static struct uring * uring_new()
+{
+	struct io_uring_params p;
+	struct uring * u;
+
+	memset(&p, 0, sizeof(p));
+
+	u = (struct uring *) calloc(sizeof(struct uring), 1);
+	u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+
+	if (u->fd < 0) {
+		free(u);
+		return 0;
+	}
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len) {
+			u->sq_len = u->cq_len;
+		}
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ptr = mmap(0, u->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ptr = u->sq_ptr;
+
+	if (u->sq_ptr != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		u->cq_ptr = mmap(0, u->cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->fd,
+				 IORING_OFF_CQ_RING);
+	}
+
+	u->sqes = mmap(0, u->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+	if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED
+	    || u->sqes == MAP_FAILED) {
+		if (u->sqes != MAP_FAILED) {
+			munmap(u->sqes, u->sqes_len);
+		}
+		if (u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr) {
+			munmap(u->cq_ptr, u->cq_len);
+		}
+		if (u->sq_ptr != MAP_FAILED) {
+			munmap(u->sq_ptr, u->sq_len);
+		}
+		close(u->fd);
+		free(u);
+		return 0;
+	}
+
+	u->sq_tail = (unsigned int *) (u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned int *) (u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *) (u->sq_ptr + p.sq_off.array);
+
+	u->cq_head = (unsigned int *) (u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned int *) (u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned int *) (u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (u->cq_ptr + p.cq_off.cqes);
+
+	return u;
+}
+
+static struct uring * uring_get()
+{
+	struct uring * u;
+
+	if (__atomic_load_n(&uring_broken, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	u = pthread_getspecific(uring_key);
+
+	if (!u) {
+		u = uring_new();
+
+		if (!u) {
+			__atomic_store_n(&uring_broken, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+
+		pthread_setspecific(uring_key, u);
+	}
+
+	return u;
+}
+
+/* returns -1 if the pool has to take over */
+static int chunk_reads_uring(struct chunk_read * r, size_t n)
+{
+	struct uring * u = uring_get();
+	struct iovec iov[URING_ENTRIES];
+	int fds[URING_ENTRIES];
+	size_t done;
+
+	if (!u) {
+		return -1;
+	}
+
+	for (done = 0; done < n;) {
+		size_t batch = n - done;
+		unsigned int tail = *u->sq_tail;
+		unsigned int head;
+		size_t reaped = 0;
+		size_t i;
+
+		if (batch > URING_ENTRIES) {
+			batch = URING_ENTRIES;
+		}
+
+		for (i = 0; i < batch; i++) {
+			struct chunk_read * cr = &r[done + i];
+			unsigned int idx = (tail + i) & *u->sq_mask;
+			struct io_uring_sqe * sqe = &u->sqes[idx];
+
+			fds[i] = cr->c ? chunk_pin(cr->c) : -1;
+
+			iov[i].iov_base = cr->buf;
+			iov[i].iov_len = cr->len;
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = fds[i];
+			sqe->off = cr->offset;
+			sqe->addr = (uintptr_t) &iov[i];
+			sqe->len = 1;
+			sqe->user_data = i;
+
+			if (fds[i] < 0) {
+				sqe->opcode = IORING_OP_NOP;
+			}
+
+			u->sq_array[idx] = idx;
+		}
+
+		__atomic_store_n(u->sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+		if (syscall(__NR_io_uring_enter, u->fd, batch, batch,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+			/* nothing got submitted, the pool takes it all */
+			__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+			for (i = 0; i < batch; i++) {
+				if (fds[i] >= 0) {
+					chunk_unpin(r[done + i].c);
+				}
+			}
+			__atomic_store_n(&uring_broken, 1, __ATOMIC_RELAXED);
+			chunk_reads_pool(r + done, n - done);
+			return 0;
+		}
+
+		head = *u->cq_head;
+
+		while (reaped < batch) {
+			struct io_uring_cqe * cqe;
+			struct chunk_read * cr;
+
+			if (head == __atomic_load_n(u->cq_tail,
+						    __ATOMIC_ACQUIRE)) {
+				syscall(__NR_io_uring_enter, u->fd, 0, 1,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+				continue;
+			}
+
+			cqe = &u->cqes[head & *u->cq_mask];
+			cr = &r[done + cqe->user_data];
+
+			if (cr->c) {
+				cr->rv = fds[cqe->user_data] < 0
+					? fds[cqe->user_data] : cqe->res;
+			}
+
+			head++;
+			reaped++;
+		}
+
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+		for (i = 0; i < batch; i++) {
+			if (fds[i] >= 0) {
+				chunk_unpin(r[done + i].c);
+			}
+		}
+
+		done += batch;
+	}
+
+	return 0;
+}
+
+/* reads count bytes starting at offset in chunk first, count > 0 */
+static ssize_t read_chunks_parallel(struct concat_file * cf, size_t first,
+				    void * buf, size_t count, off_t offset)
+{
+	struct chunk_read * r;
+	ssize_t bytes_read = 0;
+	size_t n = 0;
+	size_t i;
+	off_t end = offset + count;
+
+	r = (struct chunk_read *) calloc(sizeof(struct chunk_read),
+					 find_chunk(cf, first, end - 1)
+					 - first + 1);
+
+	for (i = first; offset < end; i++) {
+		struct chunk * c = &cf->chunks[i];
+		off_t coffset = offset - c->start;
+		size_t len = end - offset;
+
+		if (len > chunk_size(c) - coffset) {
+			len = chunk_size(c) - coffset;
+		}
+
+		if (len == 0) {
+			continue;
+		}
+
+		r[n].c = c;
+		r[n].buf = buf;
+		r[n].len = len;
+		r[n].offset = c->offset + coffset;
+
+		if (c->kind != CHUNK_FILE) {
+			r[n].rv = chunk_fill(c, buf, len, coffset);
+			r[n].c = 0;
+		}
+		n++;
+
+		buf += len;
+		offset += len;
+	}
+
+	if (io_mode != IO_URING || chunk_reads_uring(r, n) < 0) {
+		chunk_reads_pool(r, n);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (r[i].rv < 0) {
+			if (bytes_read == 0) {
+				bytes_read = r[i].rv;
+			}
+			break;
+		}
+
+		bytes_read += r[i].rv;
+
+		if (r[i].rv < r[i].len) {
+			break;
+		}
+	}
+
+	free(r);
+
+	return bytes_read;
+}
+
+/* random reads go through the block cache, sequential ones bypass it */
+static int handle_block_cached(struct concat_handle * h)
+{
+	return block_nshards
+		&& __atomic_load_n(&h->sequential, __ATOMIC_RELAXED) < 2;
+}
+
+static int read_concat_file(struct concat_handle * h,
+			    void *buf, size_t count, off_t offset)
+{
+	struct concat_file * cf = handle_file(h);
+	off_t fsize = concat_size(cf);
+	ssize_t bytes_read = 0;
+	int cached = handle_block_cached(h);
+	size_t i;
+
+	if (offset >= fsize) {
+		return 0;
+	}
+
+	if (count > fsize - offset) {
+		count = fsize - offset;
+	}
+
+	i = find_chunk(cf, __atomic_load_n(&h->hint, __ATOMIC_RELAXED), offset);
+
+	if (io_mode != IO_SYNC && !options.use_mmap && !cached
+	    && !chunk_contains(&cf->chunks[i], offset + count - 1)) {
+		bytes_read = read_chunks_parallel(cf, i, buf, count, offset);
+
+		if (bytes_read > 0) {
+			__atomic_store_n(&h->hint, find_chunk(
+						 cf, i, offset + bytes_read - 1),
+					 __ATOMIC_RELAXED);
+			concat_read_done(h, offset, bytes_read);
+		}
+
+		return bytes_read;
+	}
+
+	for (; count > 0; i++) {
+		struct chunk * c = &cf->chunks[i];
+		off_t coffset = offset - c->start;
+		size_t n = count;
+		ssize_t rv;
+
+		if (n > chunk_size(c) - coffset) {
+			n = chunk_size(c) - coffset;
+		}
+
+		rv = cached ? chunk_cached_read(c, (char *) buf, n, coffset)
+			: chunk_pread(c, buf, n, coffset);
+
+		if (rv < 0) {
+			return bytes_read ? bytes_read : rv;
+		}
+
+		__atomic_store_n(&h->hint, i, __ATOMIC_RELAXED);
+
+		buf += rv;
+		offset += rv;
+		count -= rv;
+		bytes_read += rv;
+
+		if (rv < n) {
+			break;
+		}
+	}
+
+	concat_read_done(h, offset - bytes_read, bytes_read);
+
+	return bytes_read;
+}
+
+/*
+  Hands libfuse one fd buffer per chunk the request spans, so the data
+  can be spliced straight from the chunk files into /dev/fuse.
+*/
+
+static int read_buf_concat_file(struct concat_handle * h,
+				struct fuse_bufvec ** bufp,
+				size_t count, off_t offset)
+{
+	struct concat_file * cf = handle_file(h);
+	struct deferred_pins * d = deferred_pins_get();
+	struct fuse_bufvec * bv;
+	size_t first;
+	size_t nbufs;
+	size_t i;
+	off_t roffset;
+	off_t fsize;
+	off_t end;
+
+	*bufp = 0;
+
+	deferred_pins_release(d);
+
+	fsize = concat_size(cf);
+
+	if (offset >= fsize) {
+		count = 0;
+	} else if (count > fsize - offset) {
+		count = fsize - offset;
+	}
+
+	if (count == 0) {
+		bv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+		*bv = FUSE_BUFVEC_INIT(0);
+		*bufp = bv;
+		return 0;
+	}
+
+	roffset = offset;
+	end = offset + count;
+	first = find_chunk(cf, __atomic_load_n(&h->hint, __ATOMIC_RELAXED),
+			   offset);
+
+	/*
+	  mapped, cached and parallel reads can't be spliced, they go
+	  through memory
+	*/
+	if (options.use_mmap || handle_block_cached(h)
+	    || (io_mode != IO_SYNC
+		&& !chunk_contains(&cf->chunks[first], end - 1))) {
+		int rv;
+
+		bv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+		*bv = FUSE_BUFVEC_INIT(count);
+		bv->buf[0].mem = malloc(count);
+
+		rv = read_concat_file(h, bv->buf[0].mem, count, offset);
+
+		if (rv < 0) {
+			free(bv->buf[0].mem);
+			free(bv);
+			return rv;
+		}
+
+		bv->buf[0].size = rv;
+		*bufp = bv;
+
+		return 0;
+	}
+
+	for (i = first; !chunk_contains(&cf->chunks[i], end - 1); i++) {
+	}
+
+	nbufs = i - first + 1;
+
+	bv = (struct fuse_bufvec *) calloc(
+		1, sizeof(struct fuse_bufvec)
+		+ (nbufs - 1) * sizeof(struct fuse_buf));
+
+	for (i = first; offset < end; i++) {
+		struct chunk * c = &cf->chunks[i];
+		struct fuse_buf * b = &bv->buf[bv->count];
+		off_t coffset = offset - c->start;
+		size_t n = end - offset;
+		int fd;
+
+		if (n > chunk_size(c) - coffset) {
+			n = chunk_size(c) - coffset;
+		}
+
+		if (n == 0) {
+			continue;
+		}
+
+		/* made up chunks go along as memory buffers, libfuse frees them */
+		if (c->kind != CHUNK_FILE) {
+			ssize_t rv;
+
+			b->mem = malloc(n);
+			rv = chunk_fill(c, (char *) b->mem, n, coffset);
+
+			if (rv < 0) {
+				free(b->mem);
+				b->mem = 0;
+				if (bv->count == 0) {
+					free(bv);
+					return rv;
+				}
+				break;
+			}
+
+			b->size = n;
+			b->flags = 0;
+
+			bv->count++;
+			offset += n;
+			continue;
+		}
+
+		fd = chunk_pin(c);
+
+		if (fd < 0) {
+			if (bv->count == 0) {
+				free(bv);
+				return fd;
+			}
+			break;
+		}
+
+		deferred_pins_add(d, cf, c);
+
+		b->size = n;
+		b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		b->fd = fd;
+		b->pos = c->offset + coffset;
+
+		bv->count++;
+		offset += n;
+	}
+
+	__atomic_store_n(&h->hint, i - 1, __ATOMIC_RELAXED);
+
+	concat_read_done(h, roffset, offset - roffset);
+
+	*bufp = bv;
+
+	return 0;
+}
+
+/*
+  Writes to a concat file go to the chunks holding their range. Writes
+  at or past the end extend the last chunk, or a new chunk appended to
+  the manifest if there is none or the last one is a slice or isn't
+  writable. Sizes are updated in place in the shared concat_file and the
+  cached manifest, so readers that have the file open see it grow.
+
+  A new chunk changes the manifest: the writing handle moves on to the
+  new version, other handles see the new chunk once they reopen.
+*/
+
+static int chunk_write_fd(struct concat_handle * h, size_t i)
+{
+	int fd;
+
+	if (h->wfd >= 0 && h->wchunk == i) {
+		return h->wfd;
+	}
+
+	fd = openat(src_fd, h->cf->chunks[i].path, O_WRONLY);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	if (h->wfd >= 0) {
+		close(h->wfd);
+	}
+
+	h->wfd = fd;
+	h->wchunk = i;
+
+	return fd;
+}
+
+/* records a write of len bytes to chunk i at coffset */
+static void chunk_written(struct concat_file * cf, size_t i, int fd,
+			  off_t coffset, size_t len)
+{
+	struct chunk * c = &cf->chunks[i];
+	struct manifest * m = cf->m;
+	off_t size = chunk_size(c);
+	off_t end = coffset + len;
+	struct stat stbuf;
+
+	while (end > size) {
+		if (__atomic_compare_exchange_n(&c->fsize, &size, end, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			__atomic_add_fetch(&cf->fsize, end - size,
+					   __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	/* keep the chunk_ttl revalidation from taking this for a change */
+	if (fstat(fd, &stbuf) != 0) {
+		return;
+	}
+
+	block_cache_drop(stbuf.st_dev, stbuf.st_ino, c->offset + coffset, len);
+
+	pthread_mutex_lock(&manifest_lock);
+
+	if (i < m->nchunks) {
+		struct manifest_chunk * mc = &m->chunks[i];
+
+		if (!mc->slice) {
+			m->fsize += stbuf.st_size - mc->fsize;
+			mc->fsize = stbuf.st_size;
+		}
+		mc->mtime = stbuf.st_mtim;
+
+		if (timespec_cmp(&mc->mtime, &m->newest) > 0) {
+			m->newest = mc->mtime;
+		}
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+}
+
+/*
+  undoes concat_file_add_chunk: cuts the manifest back to size and
+  removes the new chunk file
+*/
+
+static void concat_file_drop_chunk(const char * mpath, off_t size,
+				   const char * cpath)
+{
+	int fd = openat(src_fd, mpath, O_WRONLY);
+
+	if (fd >= 0) {
+		ftruncate(fd, size);
+		close(fd);
+	}
+
+	unlinkat(src_fd, cpath, 0);
+}
+
+/*
+  creates <manifest with -concat- replaced by -part->.NNNN next to the
+  manifest, lists it there and moves h to the new manifest version
+*/
+
+static int concat_file_add_chunk(struct concat_handle * h)
+{
+	struct concat_file * cf = h->cf;
+	struct concat_file * n;
+	struct manifest * m;
+	const char * mpath = cf->m->path;
+	const char * base = strrchr(mpath, '/');
+	const char * tag;
+	char cpath[PATH_MAX];
+	char line[PATH_MAX + 2];
+	struct stat stbuf;
+	unsigned int i;
+	char last = '\n';
+	int dirlen;
+	int rv = 0;
+	int fd = -1;
+
+	base = base ? base + 1 : mpath;
+	dirlen = base - mpath;
+	tag = strstr(base, "-concat-");
+
+	if (!tag) {
+		return -EIO;
+	}
+
+	for (i = cf->nchunks; fd < 0; i++) {
+		snprintf(cpath, sizeof(cpath), "%.*s%.*s-part-%s.%04u",
+			 dirlen, mpath, (int) (tag - base), base,
+			 tag + strlen("-concat-"), i);
+
+		fd = openat(src_fd, cpath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+		if (fd < 0 && errno != EEXIST) {
+			return -errno;
+		}
+	}
+
+	close(fd);
+
+	fd = openat(src_fd, mpath, O_RDWR | O_APPEND);
+
+	if (fd < 0) {
+		rv = -errno;
+		unlinkat(src_fd, cpath, 0);
+		return rv;
+	}
+
+	if (fstat(fd, &stbuf) != 0) {
+		rv = -errno;
+		close(fd);
+		unlinkat(src_fd, cpath, 0);
+		return rv;
+	}
+
+	if (stbuf.st_size > 0) {
+		pread(fd, &last, 1, stbuf.st_size - 1);
+	}
+
+	snprintf(line, sizeof(line), "%s%s\n", last == '\n' ? "" : "\n",
+		 cpath + dirlen);
+
+	if (write(fd, line, strlen(line)) != (ssize_t) strlen(line)) {
+		rv = -EIO;
+	}
+
+	close(fd);
+
+	if (rv < 0) {
+		concat_file_drop_chunk(mpath, stbuf.st_size, cpath);
+		return rv;
+	}
+
+	m = manifest_get(mpath, 0);
+
+	if (!m) {
+		concat_file_drop_chunk(mpath, stbuf.st_size, cpath);
+		return -EIO;
+	}
+
+	n = concat_file_get(m);
+
+	if (n->nchunks <= cf->nchunks) {
+		concat_file_unref(n);
+		concat_file_drop_chunk(mpath, stbuf.st_size, cpath);
+		return -EIO;
+	}
+
+	/* concurrent readers of h may still be using the old version */
+	h->retired = (struct concat_file **) realloc(
+		h->retired, (h->nretired + 1) * sizeof(struct concat_file *));
+	h->retired[h->nretired++] = cf;
+
+	__atomic_store_n(&h->cf, n, __ATOMIC_RELEASE);
+
+	if (h->wfd >= 0) {
+		close(h->wfd);
+		h->wfd = -1;
+	}
+
+	return 0;
+}
+
+static int write_concat_file(struct concat_handle * h,
+			     const char * buf, size_t size, off_t offset)
+{
+	const char * p = buf;
+	int rv = 0;
+
+	pthread_mutex_lock(&h->write_lock);
+
+	while (size > 0) {
+		struct concat_file * cf = h->cf;
+		off_t fsize = concat_size(cf);
+		off_t coffset;
+		size_t n = size;
+		ssize_t written;
+		size_t i;
+		int fd;
+
+		if (cf->nchunks == 0) {
+			if ((rv = concat_file_add_chunk(h)) < 0) {
+				break;
+			}
+			continue;
+		}
+
+		if (offset < fsize) {
+			i = find_chunk(cf, __atomic_load_n(&h->hint,
+							   __ATOMIC_RELAXED),
+				       offset);
+		} else if (cf->chunks[cf->nchunks - 1].slice) {
+			if ((rv = concat_file_add_chunk(h)) < 0) {
+				break;
+			}
+			continue;
+		} else {
+			i = cf->nchunks - 1;
+		}
+
+		coffset = offset - cf->chunks[i].start;
+
+		/* only the last chunk grows, unless it is a slice */
+		if ((i + 1 < cf->nchunks || cf->chunks[i].slice)
+		    && n > chunk_size(&cf->chunks[i]) - coffset) {
+			n = chunk_size(&cf->chunks[i]) - coffset;
+		}
+
+		if (cf->chunks[i].kind != CHUNK_FILE) {
+			rv = -EPERM;
+			break;
+		}
+
+		fd = chunk_write_fd(h, i);
+
+		if (fd < 0 && offset >= fsize
+		    && (fd == -EACCES || fd == -EPERM || fd == -EROFS)) {
+			if ((rv = concat_file_add_chunk(h)) < 0) {
+				break;
+			}
+			continue;
+		}
+
+		if (fd < 0) {
+			rv = fd;
+			break;
+		}
+
+		written = pwrite(fd, p, n, cf->chunks[i].offset + coffset);
+
+		if (written < 0) {
+			rv = -errno;
+			break;
+		}
+
+		chunk_written(cf, i, fd, coffset, written);
+
+		p += written;
+		offset += written;
+		size -= written;
+
+		if (written < n) {
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&h->write_lock);
+
+	return p > buf ? p - buf : rv;
+}
+
+/*
+  SEEK_DATA and SEEK_HOLE: zero chunks are holes, pattern chunks are
+  data and file chunks ask their file, so holes of sparse chunk files
+  show through. The end of a chunk file is no hole unless it's the end
+  of the concat file.
+*/
+
+static off_t lseek_concat_file(struct concat_handle * h, off_t off,
+			       int whence)
+{
+	struct concat_file * cf = handle_file(h);
+	off_t fsize = concat_size(cf);
+	size_t i;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
+
+	if (off < 0 || off >= fsize) {
+		return -ENXIO;
+	}
+
+	i = find_chunk(cf, __atomic_load_n(&h->hint, __ATOMIC_RELAXED), off);
+
+	for (; i < cf->nchunks; i++) {
+		struct chunk * c = &cf->chunks[i];
+		off_t end = c->start + chunk_size(c);
+		off_t rv;
+		int err;
+		int fd;
+
+		if (off < c->start) {
+			off = c->start;
+		}
+		if (off >= end) {
+			continue;
+		}
+
+		if (c->kind != CHUNK_FILE) {
+			if ((c->kind == CHUNK_ZERO) == (whence == SEEK_HOLE)) {
+				return off;
+			}
+			continue;
+		}
+
+		fd = chunk_pin(c);
+
+		if (fd < 0) {
+			return fd;
+		}
+
+		rv = lseek(fd, c->offset + off - c->start, whence);
+		err = errno;
+
+		chunk_unpin(c);
+
+		if (rv >= 0 && c->start + rv - c->offset < end) {
+			return c->start + rv - c->offset;
+		}
+
+		if (rv < 0 && err != ENXIO) {
+			return -err;
+		}
+	}
+
+	return whence == SEEK_DATA ? -ENXIO : fsize;
+}
+
+/*
+  copy_file_range from a concat file: file chunks are cloned into the
+  destination with FICLONERANGE, which only shares extents on btrfs and
+  XFS, and copied with copy_file_range where the file system can't clone
+  or the range isn't block aligned. Anything else goes through memory.
+*/
+
+#define COPY_BUF_SIZE (1 << 20)
+
+/* returns how many bytes from the start of the range were cloned */
+static size_t chunk_clone(int fd_in, off_t off_in, int fd_out, off_t off_out,
+			  size_t len)
+{
+	struct file_clone_range r;
+	struct stat stbuf;
+
+	if (fstat(fd_out, &stbuf) != 0 || stbuf.st_blksize <= 0
+	    || off_in % stbuf.st_blksize || off_out % stbuf.st_blksize) {
+		return 0;
+	}
+
+	r.src_fd = fd_in;
+	r.src_offset = off_in;
+	r.src_length = len;
+	r.dest_offset = off_out;
+
+	if (ioctl(fd_out, FICLONERANGE, &r) == 0) {
+		return len;
+	}
+
+	/* an unaligned tail can't be cloned unless it ends both files */
+	r.src_length = len - len % stbuf.st_blksize;
+
+	if (r.src_length && r.src_length < len
+	    && ioctl(fd_out, FICLONERANGE, &r) == 0) {
+		return r.src_length;
+	}
+
+	return 0;
+}
+
+/* copies len bytes at coffset of c through memory */
+static ssize_t chunk_copy_buf(struct chunk * c, off_t coffset, int fd_out,
+			      off_t off_out, size_t len)
+{
+	size_t done = 0;
+	ssize_t rv = 0;
+	char * buf;
+
+	buf = (char *) malloc(len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE);
+
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	while (done < len) {
+		size_t n = len - done;
+
+		if (n > COPY_BUF_SIZE) {
+			n = COPY_BUF_SIZE;
+		}
+
+		rv = chunk_pread(c, buf, n, coffset + done);
+
+		if (rv <= 0) {
+			break;
+		}
+
+		rv = pwrite(fd_out, buf, rv, off_out + done);
+
+		if (rv <= 0) {
+			rv = rv < 0 ? -errno : 0;
+			break;
+		}
+
+		done += rv;
+	}
+
+	free(buf);
+
+	return done ? (ssize_t) done : rv;
+}
+
+static ssize_t chunk_copy(struct chunk * c, off_t coffset, int fd_out,
+			  off_t off_out, size_t len)
+{
+	loff_t in;
+	loff_t out;
+	size_t done;
+	ssize_t rv = 0;
+	int fd;
+
+	if (c->kind != CHUNK_FILE) {
+		return chunk_copy_buf(c, coffset, fd_out, off_out, len);
+	}
+
+	fd = chunk_pin(c);
+
+	if (fd < 0) {
+		return fd;
+	}
+
+	done = chunk_clone(fd, c->offset + coffset, fd_out, off_out, len);
+
+	stat_add(&thread_stats_get()->cloned_bytes, done);
+
+	while (done < len) {
+		in = c->offset + coffset + done;
+		out = off_out + done;
+
+		rv = copy_file_range(fd, &in, fd_out, &out, len - done, 0);
+
+		if (rv <= 0) {
+			rv = rv < 0 ? -errno : 0;
+			break;
+		}
+
+		done += rv;
+	}
+
+	chunk_unpin(c);
+
+	/* e.g. EXDEV from older kernels across file systems */
+	if (!done && (rv == -EXDEV || rv == -EOPNOTSUPP || rv == -EINVAL
+		      || rv == -ENOSYS)) {
+		return chunk_copy_buf(c, coffset, fd_out, off_out, len);
+	}
+
+	return done ? (ssize_t) done : rv;
+}
+
+static ssize_t copy_concat_file(struct concat_handle * h, off_t offset,
+				int fd_out, off_t off_out, size_t len)
+{
+	struct concat_file * cf = handle_file(h);
+	off_t fsize = concat_size(cf);
+	size_t copied = 0;
+	ssize_t rv = 0;
+	size_t i;
+
+	if (offset >= fsize) {
+		return 0;
+	}
+	if (len > (size_t) (fsize - offset)) {
+		len = fsize - offset;
+	}
+
+	i = find_chunk(cf, __atomic_load_n(&h->hint, __ATOMIC_RELAXED), offset);
+
+	for (; i < cf->nchunks && copied < len; i++) {
+		struct chunk * c = &cf->chunks[i];
+		off_t coffset = offset - c->start;
+		size_t n = chunk_size(c) - coffset;
+
+		if (n > len - copied) {
+			n = len - copied;
+		}
+
+		rv = chunk_copy(c, coffset, fd_out, off_out, n);
+
+		if (rv <= 0) {
+			break;
+		}
+
+		copied += rv;
+		offset += rv;
+		off_out += rv;
+
+		if ((size_t) rv < n) {
+			break;
+		}
+	}
+
+	__atomic_add_fetch(&cf->bytes_read, copied, __ATOMIC_RELAXED);
+
+	return copied ? (ssize_t) copied : rv;
+}
+
+/*
+  Content digests. Each chunk is hashed with XXH64 and the digest of a
+  concat file is the XXH64 of its chunks' digests and lengths, in order,
+  exposed as the user.concatfs.digest xattr.
+
+  Chunk digests are kept in a table keyed by the chunk file's device,
+  inode, size and mtime plus the slice, so only chunks that changed are
+  read again. With -o hash_index=FILE the table is also appended to FILE
+  and loaded from it on mount.
+*/
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+struct xxh64 {
+	uint64_t v[4];
+	uint64_t total;
+	unsigned char buf[32];
+	size_t buffered;
+};
+
+static uint64_t xxh_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_read64(const unsigned char * p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static uint64_t xxh_read32(const unsigned char * p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_P2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= xxh_round(0, v);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(struct xxh64 * s, uint64_t seed)
+{
+	memset(s, 0, sizeof(*s));
+
+	s->v[0] = seed + XXH_P1 + XXH_P2;
+	s->v[1] = seed + XXH_P2;
+	s->v[2] = seed;
+	s->v[3] = seed - XXH_P1;
+}
+
+static void xxh64_stripe(struct xxh64 * s, const unsigned char * p)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		s->v[i] = xxh_round(s->v[i], xxh_read64(p + 8 * i));
+	}
+}
+
+static void xxh64_update(struct xxh64 * s, const void * data, size_t len)
+{
+	const unsigned char * p = (const unsigned char *) data;
+
+	s->total += len;
+
+	if (s->buffered) {
+		size_t n = sizeof(s->buf) - s->buffered;
+
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(s->buf + s->buffered, p, n);
+		s->buffered += n;
+		p += n;
+		len -= n;
+
+		if (s->buffered < sizeof(s->buf)) {
+			return;
+		}
+
+		xxh64_stripe(s, s->buf);
+		s->buffered = 0;
+	}
+
+	for (; len >= 32; p += 32, len -= 32) {
+		xxh64_stripe(s, p);
+	}
+
+	memcpy(s->buf, p, len);
+	s->buffered = len;
+}
+
+static uint64_t xxh64_digest(struct xxh64 * s)
+{
+	const unsigned char * p = s->buf;
+	size_t len = s->buffered;
+	uint64_t h;
+	int i;
+
+	if (s->total >= 32) {
+		h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7)
+			+ xxh_rotl(s->v[2], 12) + xxh_rotl(s->v[3], 18);
+		for (i = 0; i < 4; i++) {
+			h = xxh_merge(h, s->v[i]);
+		}
+	} else {
+		h = s->v[2] + XXH_P5;
+	}
+
+	h += s->total;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+	}
+
+	if (len >= 4) {
+		h ^= xxh_read32(p) * XXH_P1;
+		h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+		len -= 4;
+	}
+
+	for (; len > 0; p++, len--) {
+		h ^= *p * XXH_P5;
+		h = xxh_rotl(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static uint64_t xxh64(const void * data, size_t len, uint64_t seed)
+{
+	struct xxh64 s;
+
+	xxh64_init(&s, seed);
+	xxh64_update(&s, data, len);
+
+	return xxh64_digest(&s);
+}
+
+#define HASH_INDEX_MAGIC "CFHASH\0\1"
+#define HASH_INDEX_SIZE 4096
+#define DIGEST_XATTR "user.concatfs.digest"
+
+/* zero chunks have no file, they are keyed by their length only */
+struct hash_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t kind;
+};
+
+struct hash_rec {
+	struct hash_key key;
+	uint64_t digest;
+};
+
+struct hash_entry {
+	struct hash_entry * next;
+	struct hash_rec rec;
+};
+
+static struct hash_entry * hash_index[HASH_INDEX_SIZE];
+static pthread_mutex_t hash_lock;
+static int hash_index_fd = -1;
+
+static unsigned int hash_key_bucket(const struct hash_key * key)
+{
+	return xxh64(key, sizeof(*key), 0) % HASH_INDEX_SIZE;
+}
+
+/* called with hash_lock held */
+static struct hash_entry * hash_find(const struct hash_key * key)
+{
+	struct hash_entry * e = hash_index[hash_key_bucket(key)];
+
+	for (; e; e = e->next) {
+		if (memcmp(&e->rec.key, key, sizeof(*key)) == 0) {
+			return e;
+		}
+	}
+
+	return 0;
+}
+
+/* called with hash_lock held, returns 0 if the key was known already */
+static int hash_insert(const struct hash_rec * rec)
+{
+	struct hash_entry * e = hash_find(&rec->key);
+	unsigned int b;
+
+	if (e) {
+		e->rec.digest = rec->digest;
+		return 0;
+	}
+
+	b = hash_key_bucket(&rec->key);
+
+	e = (struct hash_entry *) malloc(sizeof(struct hash_entry));
+	e->rec = *rec;
+	e->next = hash_index[b];
+	hash_index[b] = e;
+
+	return 1;
+}
+
+static int hash_lookup(const struct hash_key * key, uint64_t * digest)
+{
+	struct hash_entry * e;
+
+	pthread_mutex_lock(&hash_lock);
+
+	if ((e = hash_find(key))) {
+		*digest = e->rec.digest;
+	}
+
+	pthread_mutex_unlock(&hash_lock);
+
+	return e != 0;
+}
+
+static void hash_store(const struct hash_key * key, uint64_t digest)
+{
+	struct hash_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.key = *key;
+	rec.digest = digest;
+
+	pthread_mutex_lock(&hash_lock);
+
+	/* records are small enough for O_APPEND to keep them whole */
+	if (hash_insert(&rec) && hash_index_fd >= 0) {
+		if (write(hash_index_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+			close(hash_index_fd);
+			hash_index_fd = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&hash_lock);
+}
+
+/* opens and loads -o hash_index, returns -errno on failure */
+static int hash_index_open(const char * path)
+{
+	char magic[sizeof(HASH_INDEX_MAGIC) - 1];
+	struct hash_rec rec;
+	ssize_t n;
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	n = pread(fd, magic, sizeof(magic), 0);
+
+	if (n == 0) {
+		if (write(fd, HASH_INDEX_MAGIC, sizeof(magic)) != sizeof(magic)) {
+			close(fd);
+			return -EIO;
+		}
+	} else if (n != sizeof(magic)
+		   || memcmp(magic, HASH_INDEX_MAGIC, sizeof(magic)) != 0) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	/* a record cut short by a crash is dropped, later ones win */
+	for (n = sizeof(magic);
+	     pread(fd, &rec, sizeof(rec), n) == sizeof(rec);
+	     n += sizeof(rec)) {
+		hash_insert(&rec);
+	}
+
+	if (ftruncate(fd, n) != 0) {
+		close(fd);
+		return -errno;
+	}
+
+	hash_index_fd = fd;
+
+	return 0;
+}
+
+static int chunk_hash_key(struct chunk * c, struct hash_key * key)
+{
+	struct stat st;
+
+	memset(key, 0, sizeof(*key));
+
+	key->offset = c->offset;
+	key->length = chunk_size(c);
+	key->kind = c->kind;
+
+	if (c->kind == CHUNK_ZERO) {
+		return 0;
+	}
+
+	if (chunk_stat(c->path, &st) != 0) {
+		return -errno;
+	}
+
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->size = st.st_size;
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+
+	return 0;
+}
+
+#define DIGEST_BUF_SIZE (1 << 20)
+
+static int chunk_digest(struct chunk * c, uint64_t * digest)
+{
+	struct hash_key key;
+	struct hash_key after;
+	struct xxh64 s;
+	off_t size = chunk_size(c);
+	off_t off;
+	char * buf;
+	int rv;
+
+	if ((rv = chunk_hash_key(c, &key)) < 0) {
+		return rv;
+	}
+
+	if (hash_lookup(&key, digest)) {
+		stat_add(&thread_stats_get()->digest_hits, 1);
+		return 0;
+	}
+
+	buf = (char *) malloc(DIGEST_BUF_SIZE);
+	xxh64_init(&s, 0);
+
+	for (off = 0; off < size; ) {
+		size_t n = size - off < DIGEST_BUF_SIZE
+			? size - off : DIGEST_BUF_SIZE;
+		ssize_t r = chunk_pread(c, buf, n, off);
+
+		if (r <= 0) {
+			free(buf);
+			return r < 0 ? r : -EIO;
+		}
+
+		xxh64_update(&s, buf, r);
+		off += r;
+	}
+
+	free(buf);
+
+	*digest = xxh64_digest(&s);
+
+	stat_add(&thread_stats_get()->hashed_bytes, size);
+
+	/* only keep digests of chunks that didn't change while reading */
+	if (chunk_hash_key(c, &after) == 0
+	    && memcmp(&key, &after, sizeof(key)) == 0) {
+		hash_store(&key, *digest);
+	}
+
+	return 0;
+}
+
+/* threads hashing chunks for digests, started with the first digest */
+#define DIGEST_THREADS 4
+
+struct chunk_hash {
+	struct task task;
+	struct chunk * c;
+	uint64_t digest;
+	int rv;
+};
+
+static void chunk_hash_run(struct task * t)
+{
+	struct chunk_hash * h = (struct chunk_hash *) t;
+
+	h->rv = chunk_digest(h->c, &h->digest);
+}
+
+/*
+  formats the digest of cf into buf as "xxh64:<hex>", returns its length.
+  Chunks are hashed in parallel on digest_pool, never on io_pool, so
+  cold digests don't hold the threads reads and stats need.
+*/
+static int concat_digest(struct concat_file * cf, char * buf, size_t size)
+{
+	struct chunk_hash * h;
+	struct task_group g;
+	struct xxh64 s;
+	int rv = 0;
+	size_t i;
+
+	h = (struct chunk_hash *) calloc(sizeof(struct chunk_hash),
+					 cf->nchunks ? cf->nchunks : 1);
+
+	task_pool_start(&digest_pool, DIGEST_THREADS);
+	task_group_init(&g, &digest_pool);
+
+	for (i = 0; i < cf->nchunks; i++) {
+		h[i].c = &cf->chunks[i];
+		h[i].task.fn = chunk_hash_run;
+		if (i > 0) {
+			task_submit(&g, &h[i].task);
+		}
+	}
+
+	if (cf->nchunks) {
+		chunk_hash_run(&h[0].task);
+	}
+
+	task_group_wait(&g);
+	task_group_destroy(&g);
+
+	xxh64_init(&s, 0);
+
+	for (i = 0; i < cf->nchunks && !rv; i++) {
+		unsigned char leaf[16];
+		uint64_t len = chunk_size(&cf->chunks[i]);
+		int b;
+
+		rv = h[i].rv;
+
+		for (b = 0; b < 8; b++) {
+			leaf[b] = h[i].digest >> (8 * b);
+			leaf[8 + b] = len >> (8 * b);
+		}
+
+		xxh64_update(&s, leaf, sizeof(leaf));
+	}
+
+	free(h);
+
+	if (rv < 0) {
+		return rv;
+	}
+
+	return snprintf(buf, size, "xxh64:%016llx",
+			(unsigned long long) xxh64_digest(&s));
+}
+
+static void stats_print_label(FILE * fp, const char * s)
+{
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"') {
+			fprintf(fp, "\\%c", *s);
+		} else if (*s == '\n') {
+			fprintf(fp, "\\n");
+		} else {
+			fputc(*s, fp);
+		}
+	}
+}
+
+/* renders a snapshot of all statistics, returns a malloc'ed buffer */
+static char * stats_render(size_t * len)
+{
+	struct thread_stats sum;
+	struct thread_stats * ts;
+	uint64_t now = now_ns();
+	char * buf = 0;
+	FILE * fp;
+	int i;
+
+	memset(&sum, 0, sizeof(sum));
+
+	pthread_mutex_lock(&stats_lock);
+	thread_stats_merge(&sum, &retired_stats);
+	for (ts = all_stats; ts; ts = ts->next) {
+		thread_stats_merge(&sum, ts);
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	fp = open_memstream(&buf, len);
+
+	fprintf(fp, "# TYPE concatfs_op_duration_seconds histogram\n");
+
+	for (i = 0; i < STAT_NOPS; i++) {
+		struct op_stats * s = &sum.ops[i];
+		const char * op = stat_op_names[i];
+		uint64_t total = 0;
+		int b;
+
+		for (b = 0; b < STATS_BUCKETS - 1; b++) {
+			total += s->buckets[b];
+			fprintf(fp, "concatfs_op_duration_seconds_bucket"
+				"{op=\"%s\",le=\"%g\"} %llu\n",
+				op, (double) (1 << b) / 1e6,
+				(unsigned long long) total);
+		}
+
+		fprintf(fp, "concatfs_op_duration_seconds_bucket"
+			"{op=\"%s\",le=\"+Inf\"} %llu\n"
+			"concatfs_op_duration_seconds_sum{op=\"%s\"} %.9f\n"
+			"concatfs_op_duration_seconds_count{op=\"%s\"} %llu\n",
+			op, (unsigned long long) s->count,
+			op, s->sum_ns / 1e9,
+			op, (unsigned long long) s->count);
+	}
+
+	fprintf(fp, "# TYPE concatfs_read_bytes_total counter\n"
+		"concatfs_read_bytes_total %llu\n"
+		"# TYPE concatfs_manifest_parses_total counter\n"
+		"concatfs_manifest_parses_total %llu\n"
+		"# TYPE concatfs_manifest_cache_hits_total counter\n"
+		"concatfs_manifest_cache_hits_total %llu\n"
+		"# TYPE concatfs_digest_hashed_bytes_total counter\n"
+		"concatfs_digest_hashed_bytes_total %llu\n"
+		"# TYPE concatfs_digest_cache_hits_total counter\n"
+		"concatfs_digest_cache_hits_total %llu\n"
+		"# TYPE concatfs_zstd_frames_decompressed_total counter\n"
+		"concatfs_zstd_frames_decompressed_total %llu\n"
+		"# TYPE concatfs_zstd_cache_hits_total counter\n"
+		"concatfs_zstd_cache_hits_total %llu\n"
+		"# TYPE concatfs_block_cache_hits_total counter\n"
+		"concatfs_block_cache_hits_total %llu\n"
+		"# TYPE concatfs_block_cache_misses_total counter\n"
+		"concatfs_block_cache_misses_total %llu\n"
+		"# TYPE concatfs_remote_bytes_total counter\n"
+		"concatfs_remote_bytes_total %llu\n"
+		"# TYPE concatfs_remote_cache_hits_total counter\n"
+		"concatfs_remote_cache_hits_total %llu\n"
+		"# TYPE concatfs_state_file_hits_total counter\n"
+		"concatfs_state_file_hits_total %llu\n"
+		"# TYPE concatfs_warmed_manifests_total counter\n"
+		"concatfs_warmed_manifests_total %llu\n"
+		"# TYPE concatfs_copied_bytes_total counter\n"
+		"concatfs_copied_bytes_total %llu\n"
+		"# TYPE concatfs_cloned_bytes_total counter\n"
+		"concatfs_cloned_bytes_total %llu\n"
+		"# TYPE concatfs_open_chunk_fds gauge\n"
+		"concatfs_open_chunk_fds %u\n",
+		(unsigned long long) sum.read_bytes,
+		(unsigned long long) sum.manifest_parses,
+		(unsigned long long) sum.manifest_hits,
+		(unsigned long long) sum.hashed_bytes,
+		(unsigned long long) sum.digest_hits,
+		(unsigned long long) sum.zstd_frames,
+		(unsigned long long) sum.zstd_hits,
+		(unsigned long long) sum.block_hits,
+		(unsigned long long) sum.block_misses,
+		(unsigned long long) sum.remote_bytes,
+		(unsigned long long) sum.remote_cache_hits,
+		(unsigned long long) sum.state_hits,
+		(unsigned long long) sum.warmed,
+		(unsigned long long) sum.copied_bytes,
+		(unsigned long long) sum.cloned_bytes,
+		__atomic_load_n(&fd_pool_size, __ATOMIC_RELAXED));
+
+	fprintf(fp, "# TYPE concatfs_file_read_bytes_total counter\n"
+		"# TYPE concatfs_file_read_bytes_per_second gauge\n");
+
+	pthread_mutex_lock(&manifest_lock);
+
+	for (i = 0; i < MANIFEST_HASH_SIZE; i++) {
+		struct manifest * m;
+
+		for (m = manifests[i]; m; m = m->next) {
+			struct concat_file * cf = m->cf;
+			const char * path = m->path;
+			uint64_t bytes;
+			double secs;
+
+			if (!cf) {
+				continue;
+			}
+
+			bytes = __atomic_load_n(&cf->bytes_read,
+						__ATOMIC_RELAXED);
+			secs = (now - cf->created) / 1e9;
+
+			fprintf(fp, "concatfs_file_read_bytes_total{path=\"/");
+			stats_print_label(fp, path);
+			fprintf(fp, "\"} %llu\n", (unsigned long long) bytes);
+
+			fprintf(fp, "concatfs_file_read_bytes_per_second"
+				"{path=\"/");
+			stats_print_label(fp, path);
+			fprintf(fp, "\"} %.0f\n", secs > 0 ? bytes / secs : 0);
+		}
+	}
+
+	pthread_mutex_unlock(&manifest_lock);
+
+	fclose(fp);
+
+	return buf;
+}
+
+struct stats_file {
+	char * buf;
+	size_t len;
+};
+
+static void stats_getattr(int dir, struct stat * stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = time(0);
+
+	if (dir) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	} else {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+	}
+}
+
+static int stats_open(struct node * n, struct fuse_file_info * fi)
+{
+	struct stats_file * sf;
+
+	if (n->kind != NODE_STATS_FILE) {
+		return -EISDIR;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+
+	sf = (struct stats_file *) calloc(sizeof(struct stats_file), 1);
+	sf->buf = stats_render(&sf->len);
+
+	/* the size isn't known upfront, so bypass the page cache */
+	fi->direct_io = 1;
+	fi->fh = (uintptr_t) sf;
+
+	return 0;
+}
+
+static void stats_read(fuse_req_t req, struct fuse_file_info * fi,
+		       size_t size, off_t offset)
+{
+	struct stats_file * sf = (struct stats_file *) (uintptr_t) fi->fh;
+
+	if (offset >= sf->len) {
+		size = 0;
+	} else if (size > sf->len - offset) {
+		size = sf->len - offset;
+	}
+
+	fuse_reply_buf(req, size ? sf->buf + offset : 0, size);
+}
+
+static off_t stats_lseek(struct fuse_file_info * fi, off_t off, int whence)
+{
+	struct stats_file * sf = (struct stats_file *) (uintptr_t) fi->fh;
+
+	if (off < 0 || off >= (off_t) sf->len) {
+		return -ENXIO;
+	}
+
+	return whence == SEEK_HOLE ? (off_t) sf->len : off;
+}
+
+static void stats_release(struct fuse_file_info * fi)
+{
+	struct stats_file * sf = (struct stats_file *) (uintptr_t) fi->fh;
+
+	free(sf->buf);
+	free(sf);
+}
+
+/*
+  stats and fills in e for name in parent, taking a lookup reference on
+  its node if that succeeds
+*/
+static int node_entry(struct node * parent, const char * name,
+		      struct fuse_entry_param * e)
+{
+	char path[PATH_MAX];
+	struct node * n;
+	int rv;
+
+	memset(e, 0, sizeof(struct fuse_entry_param));
+
+	e->attr_timeout = options.attr_timeout;
+	e->entry_timeout = options.entry_timeout;
+
+	if (parent->kind == NODE_STATS_FILE) {
+		return -ENOTDIR;
+	}
+
+	if (parent->kind == NODE_STATS_DIR) {
+		if (strcmp(name, STATS_FILE) != 0) {
+			return -ENOENT;
+		}
+
+		stats_getattr(0, &e->attr);
+		e->ino = node_ino(&stats_file_node);
+		return 0;
+	}
+
+	if (parent == &root_node && strcmp(name, STATS_DIR) == 0) {
+		stats_getattr(1, &e->attr);
+		e->ino = node_ino(&stats_dir_node);
+		return 0;
+	}
+
+	rv = node_child_path(parent, name, path, sizeof(path));
+
+	if (rv) {
+		return rv;
+	}
+
+	if (fstatat(src_fd, path, &e->attr, AT_SYMLINK_NOFOLLOW) != 0) {
+		return -errno;
+	}
+
+	n = node_lookup(parent, name);
+
+	node_attr(n, path, &e->attr);
+
+	e->ino = node_ino(n);
+
+	return 0;
+}
+
+/* replies to a call that created name in parent, rv is its result */
+static void reply_created(fuse_req_t req, struct node * parent,
+			  const char * name, int rv)
+{
+	struct fuse_entry_param e;
+
+	if (rv == 0) {
+		rv = node_entry(parent, name, &e);
+	}
+
+	if (rv) {
+		fuse_reply_err(req, -rv);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void concatfs_lookup(fuse_req_t req, fuse_ino_t parent,
+			    const char * name)
+{
+	uint64_t start = now_ns();
+	struct fuse_entry_param e;
+	int rv;
+
+	rv = node_entry(node_get(parent), name, &e);
+
+	if (stats_done(STAT_GETATTR, start, rv)) {
+		fuse_reply_err(req, -rv);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void concatfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	node_forget(node_get(ino), nlookup);
+
+	fuse_reply_none(req);
+}
+
+static void concatfs_forget_multi(fuse_req_t req, size_t count,
+				  struct fuse_forget_data * forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		node_forget(node_get(forgets[i].ino), forgets[i].nlookup);
+	}
+
+	fuse_reply_none(req);
+}
+
+static void concatfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char path[PATH_MAX];
+	char link[PATH_MAX];
+	int rv;
+
+	rv = node_path(node_get(ino), path, sizeof(path));
+
+	if (rv == 0) {
+		rv = readlinkat(src_fd, path, link, sizeof(link) - 1);
+		rv = rv < 0 ? -errno : rv;
+	}
+
+	if (rv < 0) {
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	link[rv] = '\0';
+
+	fuse_reply_readlink(req, link);
+}
+
+static void concatfs_getattr(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info * fi)
+{
+	uint64_t start = now_ns();
+	struct node * n = node_get(ino);
+	char path[PATH_MAX];
+	struct stat st;
+	int rv;
 
-	int fd;
-	off_t fsize;
-};
+	if (n->kind != NODE_SOURCE) {
+		stats_getattr(n->kind == NODE_STATS_DIR, &st);
+		fuse_reply_attr(req, &st, options.attr_timeout);
+		return;
+	}
 
-struct concat_file {
-	struct concat_file * next;
-	struct chunk * chunks;
+	memset(&st, 0, sizeof(struct stat));
 
-	int fd;
-	off_t fsize;
-	int refcount;
-};
+	rv = node_path(n, path, sizeof(path));
 
-static struct concat_file * open_files = 0;
-static pthread_mutex_t  the_lock;
+	if (rv == 0) {
+		rv = fstatat(src_fd, path, &st, AT_SYMLINK_NOFOLLOW)
+			? -errno : 0;
+	} else if (fi && !n->concat) {
+		/* unlinked while open */
+		rv = fstat(fi->fh, &st) ? -errno : 0;
+	}
 
-static void lock()
-{
-	pthread_mutex_lock(&the_lock);
+	if (rv == 0) {
+		node_attr(n, path, &st);
+	}
+
+	if (stats_done(STAT_GETATTR, start, rv)) {
+		fuse_reply_err(req, -rv);
+	} else {
+		fuse_reply_attr(req, &st, options.attr_timeout);
+	}
 }
 
-static void unlock()
+static int node_truncate(struct node * n, const char * path, off_t nsize)
 {
-	pthread_mutex_unlock(&the_lock);
+	int rv;
+	int fd;
+
+	/* that would cut into or rewrite the manifest */
+	if (n->concat) {
+		return -EPERM;
+	}
+
+	fd = openat(src_fd, path, O_WRONLY);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	rv = ftruncate(fd, nsize);
+	if (rv < 0) {
+		rv = -errno;
+	}
+	close(fd);
+	return rv;
 }
 
-static struct concat_file * open_files_find(int fd)
+static void concatfs_setattr(fuse_req_t req, fuse_ino_t ino,
+			     struct stat * attr, int to_set,
+			     struct fuse_file_info * fi)
 {
-	struct concat_file * cf;
+	struct node * n = node_get(ino);
+	char path[PATH_MAX];
+	int rv;
+
+	if (n->kind != NODE_SOURCE) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	rv = node_path(n, path, sizeof(path));
+
+	if (rv == 0 && (to_set & FUSE_SET_ATTR_MODE)) {
+		rv = fchmodat(src_fd, path, attr->st_mode, 0) ? -errno : 0;
+	}
 
-	lock();
+	if (rv == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID)
+			? attr->st_uid : (uid_t) -1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID)
+			? attr->st_gid : (gid_t) -1;
+
+		rv = fchownat(src_fd, path, uid, gid, 0) ? -errno : 0;
+	}
+
+	if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+		rv = node_truncate(n, path, attr->st_size);
+	}
+
+	if (rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec ts[2];
+
+		ts[0].tv_sec = ts[1].tv_sec = 0;
+		ts[0].tv_nsec = ts[1].tv_nsec = UTIME_OMIT;
+
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+			ts[0].tv_nsec = UTIME_NOW;
+		} else if (to_set & FUSE_SET_ATTR_ATIME) {
+			ts[0] = attr->st_atim;
+		}
 
-	for (cf = open_files; cf; cf = cf->next) {
-		if (cf->fd == fd) {
-			unlock();
-			return cf;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+			ts[1].tv_nsec = UTIME_NOW;
+		} else if (to_set & FUSE_SET_ATTR_MTIME) {
+			ts[1] = attr->st_mtim;
 		}
+
+		rv = utimensat(src_fd, path, ts, AT_SYMLINK_NOFOLLOW)
+			? -errno : 0;
+	}
+
+	if (rv) {
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	concatfs_getattr(req, ino, fi);
+}
+
+/*
+  Directory handles keep the DIR open across readdir calls and hand out
+  the entry index as offset, so large directories are listed
+  incrementally. readdirplus entries come with their attributes, concat
+  files with the size from the manifest cache, and the root additionally
+  lists the stats directory after its last real entry.
+*/
+
+struct dir_handle {
+	DIR * dp;
+	struct dirent * entry;
+	struct node * node;
+	off_t offset;
+	int stats_listed;
+};
+
+/* returns the name of the entry at d->offset, 0 at the end */
+static const char * dir_handle_peek(struct dir_handle * d)
+{
+	if (!d->entry) {
+		d->entry = readdir(d->dp);
+	}
+
+	if (d->entry) {
+		return d->entry->d_name;
+	}
+
+	if (d->node == &root_node && !d->stats_listed) {
+		return STATS_DIR;
 	}
-	
-	unlock();
 
 	return 0;
 }
 
-static void open_files_push_front(struct concat_file * cf)
+static void dir_handle_next(struct dir_handle * d)
+{
+	if (d->entry) {
+		d->entry = 0;
+	} else {
+		d->stats_listed = 1;
+	}
+
+	d->offset++;
+}
+
+static void dir_handle_seek(struct dir_handle * d, off_t offset)
 {
-	lock();
+	rewinddir(d->dp);
+
+	d->entry = 0;
+	d->offset = 0;
+	d->stats_listed = 0;
 
-	cf->next = open_files;
-	open_files = cf;
+	while (d->offset < offset && dir_handle_peek(d)) {
+		dir_handle_next(d);
+	}
+}
 
-	unlock();
+static int is_dot_or_dotdot(const char * name)
+{
+	return name[0] == '.'
+		&& (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
 }
 
-static struct concat_file * open_files_erase(int fd)
+/*
+  fills in e for the entry at d->offset in the directory at path, a full
+  entry with a lookup reference for readdirplus
+*/
+static void dir_handle_entry(struct dir_handle * d, const char * path,
+			     const char * name, int plus,
+			     struct fuse_entry_param * e)
 {
-	struct concat_file * rv = 0;
-	struct concat_file * p;
+	char fpath[PATH_MAX];
+	struct node * n;
 
-	lock();
+	memset(e, 0, sizeof(struct fuse_entry_param));
 
-	if (open_files && open_files->fd == fd) {
-		rv = open_files;
-		open_files = rv->next;
+	if (!d->entry) {
+		stats_getattr(1, &e->attr);
 	} else {
-		for (p = open_files; p; p = p->next) {
-			if (p->next && p->next->fd == fd) {
-				break;
-			}
-		}
+		e->attr.st_ino = d->entry->d_ino;
+		e->attr.st_mode = DTTOIF(d->entry->d_type);
+	}
 
-		if (p) {
-			rv = p->next;
-			p->next = p->next->next;
-		}
+	/* ino 0 entries only fill the dentry, like plain readdir ones */
+	if (!plus || is_dot_or_dotdot(name)) {
+		return;
 	}
 
-	if (rv) {
-		rv->next = 0;
+	e->attr_timeout = options.attr_timeout;
+	e->entry_timeout = options.entry_timeout;
+
+	if (!d->entry) {
+		e->ino = node_ino(&stats_dir_node);
+		return;
 	}
 
-	unlock();
+	if (child_path(path, name, fpath, sizeof(fpath)) != 0
+	    || fstatat(dirfd(d->dp), name, &e->attr, AT_SYMLINK_NOFOLLOW) != 0) {
+		return;
+	}
 
-	return rv;
+	n = node_lookup(d->node, name);
+
+	node_attr(n, fpath, &e->attr);
+
+	e->ino = node_ino(n);
 }
 
-static struct concat_file * open_concat_file(int fd, const char * path)
+static void concatfs_opendir(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info * fi)
 {
-	struct concat_file * rv = 0;
-	char bpath[PATH_MAX+1];
-	char fpath[PATH_MAX+1];
-	char * base_dir;
-	struct stat stbuf;
-	struct chunk * c = 0;
-	
-	FILE * fp;
+	struct node * n = node_get(ino);
+	char path[PATH_MAX];
+	struct dir_handle * d;
+	DIR * dp;
+	int fd;
+	int rv;
 
-	if (fd >= 0) {
-		fp = fdopen(dup(fd), "r");
-	} else {
-		fp = fopen(path, "r");
+	if (n->kind == NODE_STATS_DIR) {
+		fi->fh = 0;
+		fuse_reply_open(req, fi);
+		return;
 	}
 
-	if (!fp) {
-		return 0;
+	if (n->kind != NODE_SOURCE) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
 	}
 
-	rv = (struct concat_file *) calloc(sizeof(struct concat_file), 1);
-	strncpy(bpath, path, sizeof(bpath));
+	rv = node_path(n, path, sizeof(path));
 
-	base_dir = dirname(bpath);
+	if (rv) {
+		fuse_reply_err(req, -rv);
+		return;
+	}
 
-	fpath[PATH_MAX] = 0;
-	bpath[PATH_MAX] = 0;
+	fd = openat(src_fd, path, O_RDONLY | O_DIRECTORY);
 
-	rv->fd = fd;
-	rv->refcount = 1;
+	if (fd < 0) {
+		fuse_reply_err(req, errno);
+		return;
+	}
 
-	while (fgets(fpath, sizeof(fpath), fp)) {
-		char tpath[PATH_MAX];
-		struct chunk * c_n;
+	dp = fdopendir(fd);
 
-		fpath[strlen(fpath) - 1] = 0;
+	if (!dp) {
+		int err = errno;
 
-		if (fpath[0] == '/') {
-			strncpy(tpath, fpath, sizeof(tpath));
-		} else {
-			snprintf(tpath, sizeof(tpath), "%s/%s",base_dir, fpath);
+		close(fd);
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	d = (struct dir_handle *) calloc(sizeof(struct dir_handle), 1);
+
+	d->dp = dp;
+	d->node = n;
+
+	fi->fh = (uintptr_t) d;
+
+	if (fuse_reply_open(req, fi) != 0) {
+		closedir(dp);
+		free(d);
+	}
+}
+
+static void concatfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+				struct fuse_file_info * fi)
+{
+	struct dir_handle * d = (struct dir_handle *) (uintptr_t) fi->fh;
+
+	if (d) {
+		closedir(d->dp);
+		free(d);
+	}
+
+	fuse_reply_err(req, 0);
+}
+
+static size_t add_direntry(fuse_req_t req, char * buf, size_t size,
+			   const char * name, struct fuse_entry_param * e,
+			   off_t off, int plus)
+{
+	if (plus) {
+		return fuse_add_direntry_plus(req, buf, size, name, e, off);
+	}
+
+	return fuse_add_direntry(req, buf, size, name, e ? &e->attr : 0, off);
+}
+
+/* the stats directory, listed in one go */
+static size_t stats_readdir(fuse_req_t req, char * buf, size_t size,
+			    off_t offset, int plus)
+{
+	static const char * names[] = { ".", "..", STATS_FILE };
+	size_t pos = 0;
+	off_t i;
+
+	for (i = offset; i < 3; i++) {
+		struct fuse_entry_param e;
+		size_t len = add_direntry(req, 0, 0, names[i], 0, 0, plus);
+
+		if (len > size - pos) {
+			break;
 		}
-		if (stat(tpath, &stbuf) == 0) {
-			rv->fsize += stbuf.st_size;
+
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+
+		if (i < 2) {
+			e.attr.st_mode = S_IFDIR;
 		} else {
-			continue;
+			stats_getattr(0, &e.attr);
+			e.ino = plus ? node_ino(&stats_file_node) : 0;
+			e.attr_timeout = options.attr_timeout;
+			e.entry_timeout = options.entry_timeout;
 		}
 
-		if (fd >= 0) {
-			c_n = (struct chunk *) calloc(sizeof(struct chunk), 1);
+		pos += add_direntry(req, buf + pos, size - pos, names[i], &e,
+				    i + 1, plus);
+	}
 
-			c_n->fsize = stbuf.st_size;
-			c_n->fd = open(tpath, O_RDONLY);
+	return pos;
+}
 
-			if (c) {
-				c->next = c_n;
-			} else {
-				rv->chunks = c_n;
-			}
-			c = c_n;
+static void dir_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		     off_t offset, struct fuse_file_info * fi, int plus)
+{
+	struct dir_handle * d = (struct dir_handle *) (uintptr_t) fi->fh;
+	uint64_t start = now_ns();
+	char path[PATH_MAX];
+	const char * name;
+	size_t pos = 0;
+	char * buf;
+	int rv;
+
+	buf = (char *) malloc(size);
+
+	if (!d) {
+		pos = stats_readdir(req, buf, size, offset, plus);
+		fuse_reply_buf(req, buf, pos);
+		free(buf);
+		return;
+	}
+
+	rv = node_path(d->node, path, sizeof(path));
+
+	if (rv) {
+		free(buf);
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	if (offset != d->offset) {
+		dir_handle_seek(d, offset);
+	}
+
+	while ((name = dir_handle_peek(d))) {
+		struct fuse_entry_param e;
+		size_t len = add_direntry(req, 0, 0, name, 0, 0, plus);
+
+		/* checked first, so entries that don't fit take no reference */
+		if (len > size - pos) {
+			break;
 		}
+
+		dir_handle_entry(d, path, name, plus, &e);
+
+		pos += add_direntry(req, buf + pos, size - pos, name, &e,
+				    d->offset + 1, plus);
+
+		dir_handle_next(d);
 	}
-	fclose(fp);	
-	return rv;
+
+	stats_done(STAT_READDIR, start, 0);
+
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
 }
 
+static void concatfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t offset, struct fuse_file_info * fi)
+{
+	dir_read(req, ino, size, offset, fi, 0);
+}
 
-static void close_concat_file(struct concat_file * cf)
+static void concatfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+				 off_t offset, struct fuse_file_info * fi)
 {
-	struct chunk * c;
+	dir_read(req, ino, size, offset, fi, 1);
+}
 
-	if (!cf) {
-		return;
+static struct concat_handle * get_concat_handle(struct fuse_file_info * fi)
+{
+	return (struct concat_handle *) (uintptr_t) fi->fh;
+}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+
+/*
+  With -o passthrough, the kernel serves plain files and read-only
+  opens of concat files made of one whole chunk file from a backing
+  file registered at open, without any request to concatfs.
+
+  The kernel doesn't allow passthrough and cached opens of an inode at
+  the same time, and all passthrough opens have to share a backing id.
+  So the first open of a node decides until the last one is released:
+  later opens reuse its backing id, and those that can't bypass the page
+  cache. Registering needs CAP_SYS_ADMIN; once it fails, passthrough is
+  turned off for the mount.
+*/
+
+static int passthrough_on = 0;
+
+/* sets up fi for the open of n, fd is the backing file or -1 */
+static void passthrough_open(fuse_req_t req, struct node * n, int fd,
+			     struct fuse_file_info * fi)
+{
+	struct stat st;
+
+	if (fd >= 0 && fstat(fd, &st) != 0) {
+		fd = -1;
 	}
 
-	for (c = cf->chunks; c;) {
-		struct chunk * t;
+	pthread_mutex_lock(&node_lock);
 
-		close(c->fd);
-		
-		t = c;
+	if (n->opens++ == 0) {
+		/* left over from an open whose reply failed */
+		if (n->backing_id) {
+			fuse_passthrough_close(req, n->backing_id);
+			n->backing_id = 0;
+		}
 
-		c = c->next;
+		if (fd >= 0 && __atomic_load_n(&passthrough_on,
+					       __ATOMIC_RELAXED)) {
+			n->backing_id = fuse_passthrough_open(req, fd);
+			n->backing_dev = st.st_dev;
+			n->backing_ino = st.st_ino;
 
-		free(t);
+			if (n->backing_id <= 0) {
+				n->backing_id = 0;
+				__atomic_store_n(&passthrough_on, 0,
+						 __ATOMIC_RELAXED);
+			}
+		}
 	}
 
-	close(cf->fd);
-	
-	free(cf);
+	if (n->backing_id && fd >= 0 && st.st_dev == n->backing_dev
+	    && st.st_ino == n->backing_ino) {
+		fi->backing_id = n->backing_id;
+	} else if (n->backing_id) {
+		fi->direct_io = 1;
+	}
+
+	pthread_mutex_unlock(&node_lock);
 }
 
-static off_t get_concat_file_size(const char * path)
+/* req is 0 where the open reply failed */
+static void passthrough_release(fuse_req_t req, struct node * n)
 {
-	struct concat_file * c = open_concat_file(-1, path);
-	off_t rv;
+	pthread_mutex_lock(&node_lock);
 
-	if (!c) {
-		return 0;
+	if (--n->opens == 0 && n->backing_id && req) {
+		fuse_passthrough_close(req, n->backing_id);
+		n->backing_id = 0;
 	}
 
-	rv = c->fsize;
+	pthread_mutex_unlock(&node_lock);
+}
 
-	close_concat_file(c);
+#else
 
-	return rv;
+static void passthrough_open(fuse_req_t req, struct node * n, int fd,
+			     struct fuse_file_info * fi)
+{
 }
 
-static int read_concat_file(int fd, void *buf, size_t count, off_t offset)
+static void passthrough_release(fuse_req_t req, struct node * n)
 {
-	struct concat_file * cf = open_files_find(fd);
-	struct chunk * c;
-	ssize_t bytes_read = 0;
+}
 
-	if (!cf) {
-		return -EINVAL;
-	}
+#endif
 
-	if (offset > cf->fsize) {
+/* the chunk file a concat file is made of, if it's one */
+static struct chunk * passthrough_chunk(struct concat_handle * h,
+					 struct fuse_file_info * fi)
+{
+	struct concat_file * cf = handle_file(h);
+	struct chunk * c = &cf->chunks[0];
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY || cf->nchunks != 1
+	    || c->kind != CHUNK_FILE || c->slice) {
 		return 0;
 	}
-	
-	c = cf->chunks;
 
-	for (; c && offset > c->fsize; c = c->next) {
-		offset -= c->fsize;
+	return c;
+}
+
+/* fills in fi->fh for the freshly opened fd of n at path */
+static int open_handle(fuse_req_t req, struct node * n, int fd,
+		       const char * path, struct fuse_file_info * fi)
+{
+	struct concat_handle * h;
+	struct chunk * c;
+	struct stat st;
+	int keep_cache;
+	int cfd = -1;
+
+	if (!n->concat) {
+		fi->fh = fd;
+		if (options.passthrough) {
+			passthrough_open(req, n, fd, fi);
+		}
+		return 0;
 	}
 
-	for (; c && count > c->fsize - offset; c = c->next) {
-		ssize_t rv = pread(c->fd, buf, c->fsize - offset, offset);
+	h = fstat(fd, &st) == 0
+		? open_concat_file(fd, node_manifest(n, path, &st), &keep_cache)
+		: 0;
 
-		if (rv == c->fsize - offset) {
-			buf += rv;
-			offset = 0;
-			count -= rv;
-			bytes_read += rv;
-		} else if (rv > 0) {
-			bytes_read += rv;
-			return bytes_read;
-		} else {
-			return -errno;
-		}
+	if (!h) {
+		close(fd);
+		return -EIO;
 	}
-	
-	if (c && count > 0) {
-		ssize_t rv = pread(c->fd, buf, count, offset);
 
-		if (rv < 0) {
-			return -errno;
-		}
+	fi->fh = (uintptr_t) h;
+	fi->keep_cache = keep_cache;
 
-		bytes_read += rv;
+	if (options.passthrough) {
+		c = passthrough_chunk(h, fi);
+		cfd = c ? chunk_pin(c) : -1;
+
+		passthrough_open(req, n, cfd, fi);
+
+		if (cfd >= 0) {
+			chunk_unpin(c);
+		}
 	}
 
-	return bytes_read;
+	return 0;
 }
 
-static int is_concatfs_file(const char * path)
+static void release_handle(fuse_req_t req, struct node * n,
+			   struct fuse_file_info * fi)
 {
-	char fpath[PATH_MAX];
+	if (n->kind != NODE_SOURCE) {
+		stats_release(fi);
+		return;
+	}
 
-	strncpy(fpath, path, sizeof(fpath));
+	if (options.passthrough) {
+		passthrough_release(req, n);
+	}
 
-	return (strstr(basename(fpath), "-concat-") != 0);
+	if (n->concat) {
+		close_concat_file(get_concat_handle(fi));
+	} else {
+		close(fi->fh);
+	}
 }
 
-static int concatfs_readlink(const char *path, char *link, size_t size)
+static void concatfs_open(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info * fi)
 {
-	int rv = 0;
-	char fpath[PATH_MAX];
+	uint64_t start = now_ns();
+	struct node * n = node_get(ino);
+	char path[PATH_MAX];
+	int rv;
 
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
-    
-	rv = readlink(fpath, link, size - 1);
-	if (rv < 0) {
-		rv = -errno;
-	} else {
-		link[rv] = '\0';
-		rv = 0;
+	if (n->kind != NODE_SOURCE) {
+		rv = stats_open(n, fi);
+	} else if ((rv = node_path(n, path, sizeof(path))) == 0) {
+		/* the manifest is only held open, never written through it */
+		int fd = openat(src_fd, path,
+				n->concat ? fi->flags & ~O_TRUNC : fi->flags);
+
+		rv = fd < 0 ? -errno : open_handle(req, n, fd, path, fi);
+	}
+
+	if (stats_done(STAT_OPEN, start, rv)) {
+		fuse_reply_err(req, -rv);
+	} else if (fuse_reply_open(req, fi) != 0) {
+		release_handle(0, n, fi);
 	}
-	
-	return rv;
 }
-static int concatfs_getattr(const char *path, struct stat *stbuf)
+
+static void concatfs_release(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info * fi)
 {
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
+	release_handle(req, node_get(ino), fi);
 
-	memset(stbuf, 0, sizeof(struct stat));
+	fuse_reply_err(req, 0);
+}
 
-	if (lstat(fpath, stbuf) != 0)
-		return -errno;
-	
-	if (is_concatfs_file(path)) {
-		stbuf->st_size = get_concat_file_size(fpath);
-	} 
+static void free_bufvec(struct fuse_bufvec * bv)
+{
+	size_t i;
+
+	for (i = 0; i < bv->count; i++) {
+		if (!(bv->buf[i].flags & FUSE_BUF_IS_FD)) {
+			free(bv->buf[i].mem);
+		}
+	}
 
-	return 0;
+	free(bv);
 }
 
-static int concatfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			    off_t offset, struct fuse_file_info *fi)
+static void concatfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			  off_t offset, struct fuse_file_info * fi)
 {
-	int retstat = 0;
-	DIR *dp;
-	struct dirent *de;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
-
-	dp = opendir(fpath);
+	uint64_t start = now_ns();
+	struct node * n = node_get(ino);
+	struct fuse_bufvec * bv = 0;
+	int rv;
 
-	if (!dp) {
-		return -errno;
+	if (n->kind != NODE_SOURCE) {
+		stats_read(req, fi, size, offset);
+		return;
 	}
 
-	de = readdir(dp);
-	if (de == 0) {
-		closedir(dp);
-		return -errno;
-	}
-	
-	do {
-		if (filler(buf, de->d_name, NULL, 0) != 0) {
-			closedir(dp);
-			return -ENOMEM;
-		}
-	} while ((de = readdir(dp)) != NULL);
-	
-	closedir(dp);
+	if (!n->concat) {
+		struct fuse_bufvec buf;
+		struct stat st;
 
-	return retstat;
-}
+		/* the splice is cut at EOF, so count only what's there */
+		if (fstat(fi->fh, &st) == 0) {
+			if (offset >= st.st_size) {
+				size = 0;
+			} else if (size > (size_t) (st.st_size - offset)) {
+				size = st.st_size - offset;
+			}
+		}
 
-static int concatfs_open(const char *path, struct fuse_file_info *fi)
-{
-	int fd;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
+		buf = FUSE_BUFVEC_INIT(size);
+		buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf.buf[0].fd = fi->fh;
+		buf.buf[0].pos = offset;
 
-	fd = open(fpath, fi->flags);
+		stat_add(&thread_stats_get()->read_bytes, size);
+		stats_done(STAT_READ, start, 0);
 
-	if (fd < 0) {
-		return -errno;
+		fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+		return;
 	}
 
-	fi->fh = fd;
+	rv = read_buf_concat_file(get_concat_handle(fi), &bv, size, offset);
 
-	if (is_concatfs_file(path)) {
-		open_files_push_front(open_concat_file(fd, fpath));
+	if (rv == 0) {
+		stat_add(&thread_stats_get()->read_bytes, fuse_buf_size(bv));
 	}
 
-	return 0;
+	if (stats_done(STAT_READ, start, rv)) {
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+
+	free_bufvec(bv);
+	deferred_pins_release(deferred_pins_get());
 }
 
-static int concatfs_release(const char * path, struct fuse_file_info * fi)
+static void concatfs_write(fuse_req_t req, fuse_ino_t ino, const char * buf,
+			   size_t size, off_t offset,
+			   struct fuse_file_info * fi)
 {
-	if (is_concatfs_file(path)) {
-		close_concat_file(open_files_erase(fi->fh));
+	struct node * n = node_get(ino);
+	ssize_t rv;
+
+	if (n->kind != NODE_SOURCE) {
+		rv = -EBADF;
+	} else if (n->concat) {
+		rv = write_concat_file(get_concat_handle(fi), buf, size, offset);
 	} else {
-		close(fi->fh);
+		rv = pwrite(fi->fh, buf, size, offset);
+		if (rv < 0) {
+			rv = -errno;
+		}
 	}
 
-	return 0;
+	if (rv < 0) {
+		fuse_reply_err(req, -rv);
+	} else {
+		fuse_reply_write(req, rv);
+	}
 }
 
-static int concatfs_read(const char *path, char *buf, size_t size, off_t offset,
-			 struct fuse_file_info *fi)
+/*
+  Only copies into plain files are done here, the kernel falls back to
+  reading and writing for everything else.
+*/
+
+static void concatfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+				     off_t off_in,
+				     struct fuse_file_info * fi_in,
+				     fuse_ino_t ino_out, off_t off_out,
+				     struct fuse_file_info * fi_out,
+				     size_t len, int flags)
 {
-	int rv = 0;
+	struct node * in = node_get(ino_in);
+	struct node * out = node_get(ino_out);
+	ssize_t rv;
+
+	if (in->kind != NODE_SOURCE || out->kind != NODE_SOURCE
+	    || out->concat || flags) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
 
-	if (is_concatfs_file(path)) {
-		return read_concat_file(fi->fh, buf, size, offset);
+	if (in->concat) {
+		rv = copy_concat_file(get_concat_handle(fi_in), off_in,
+				      fi_out->fh, off_out, len);
 	} else {
-		rv = pread(fi->fh, buf, size, offset);
+		loff_t i = off_in;
+		loff_t o = off_out;
+
+		rv = copy_file_range(fi_in->fh, &i, fi_out->fh, &o, len, 0);
 		if (rv < 0) {
-			return -errno;
+			rv = -errno;
+		}
+		if (rv == -EXDEV) {
+			rv = -EOPNOTSUPP;
 		}
 	}
 
-	return rv;
+	if (rv < 0) {
+		fuse_reply_err(req, -rv);
+	} else {
+		stat_add(&thread_stats_get()->copied_bytes, rv);
+		fuse_reply_write(req, rv);
+	}
 }
 
-static int concatfs_write(
-	const char *path, const char *buf, size_t size, off_t offset,
-	struct fuse_file_info *fi)
+static void concatfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+			   int whence, struct fuse_file_info * fi)
 {
-	int rv = 0;
+	struct node * n = node_get(ino);
+	off_t rv;
 
-	if (is_concatfs_file(path)) {
-		return -EINVAL;
+	if (n->kind != NODE_SOURCE) {
+		rv = stats_lseek(fi, off, whence);
+	} else if (n->concat) {
+		rv = lseek_concat_file(get_concat_handle(fi), off, whence);
 	} else {
-		rv = pwrite(fi->fh, buf, size, offset);
+		rv = lseek(fi->fh, off, whence);
 		if (rv < 0) {
-			return -errno;
+			rv = -errno;
 		}
 	}
 
-	return rv;
+	if (rv < 0) {
+		fuse_reply_err(req, -rv);
+	} else {
+		fuse_reply_lseek(req, rv);
+	}
 }
 
-static int concatfs_mknod(const char *path, mode_t mode, dev_t dev)
+/* replies to getxattr or listxattr with the len bytes of value */
+static void reply_xattr(fuse_req_t req, const char * value, int len,
+			size_t size)
 {
-	int rv;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
-
-	rv = mknod(fpath, mode, dev);
-	if (rv < 0) {
-		return -errno;
+	if (len < 0) {
+		fuse_reply_err(req, -len);
+	} else if (size == 0) {
+		fuse_reply_xattr(req, len);
+	} else if (size < (size_t) len) {
+		fuse_reply_err(req, ERANGE);
+	} else {
+		fuse_reply_buf(req, value, len);
 	}
-	return rv;
 }
 
-static int concatfs_mkdir(const char *path, mode_t mode)
+/* concat files have their digest as only xattr, other files have none */
+static void concatfs_getxattr(fuse_req_t req, fuse_ino_t ino,
+			      const char * name, size_t size)
 {
+	struct node * n = node_get(ino);
+	char path[PATH_MAX];
+	char digest[64];
+	struct manifest * m;
+	struct concat_file * cf;
 	int rv;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
 
-	rv = mkdir(fpath, mode);
-	if (rv < 0) {
-		return -errno;
+	if (strcmp(name, DIGEST_XATTR) != 0 || !n->concat) {
+		fuse_reply_err(req, ENODATA);
+		return;
 	}
-	return rv;
+
+	rv = node_path(n, path, sizeof(path));
+
+	if (rv == 0) {
+		m = node_manifest(n, path, 0);
+
+		if (!m) {
+			rv = -ENOENT;
+		} else {
+			cf = concat_file_get(m);
+			rv = concat_digest(cf, digest, sizeof(digest));
+			concat_file_unref(cf);
+		}
+	}
+
+	reply_xattr(req, digest, rv, size);
 }
 
-static int concatfs_unlink(const char *path)
+static void concatfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-	int rv;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
-
-	rv = unlink(fpath);
-	if (rv < 0) {
-		return -errno;
+	if (!node_get(ino)->concat) {
+		reply_xattr(req, 0, 0, size);
+		return;
 	}
-	return rv;
+
+	reply_xattr(req, DIGEST_XATTR, sizeof(DIGEST_XATTR), size);
 }
 
-static int concatfs_rmdir(const char *path)
+static void concatfs_mknod(fuse_req_t req, fuse_ino_t parent,
+			   const char * name, mode_t mode, dev_t dev)
 {
+	char path[PATH_MAX];
 	int rv;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
 
-	rv = rmdir(fpath);
-	if (rv < 0) {
-		return -errno;
+	rv = node_child_path(node_get(parent), name, path, sizeof(path));
+
+	if (rv == 0 && mknodat(src_fd, path, mode, dev) < 0) {
+		rv = -errno;
 	}
-	return rv;
+
+	reply_created(req, node_get(parent), name, rv);
 }
 
-static int concatfs_symlink(const char *path, const char * link)
+static void concatfs_mkdir(fuse_req_t req, fuse_ino_t parent,
+			   const char * name, mode_t mode)
 {
+	char path[PATH_MAX];
 	int rv;
-	char flink[PATH_MAX];
-    
-	snprintf(flink, sizeof(flink), "%s/%s", src_dir, path);
 
-	rv = symlink(path, flink);
-	if (rv < 0) {
-		return -errno;
+	rv = node_child_path(node_get(parent), name, path, sizeof(path));
+
+	if (rv == 0 && mkdirat(src_fd, path, mode) < 0) {
+		rv = -errno;
 	}
-	return rv;
+
+	reply_created(req, node_get(parent), name, rv);
 }
 
-static int concatfs_rename(const char *path, const char *topath)
+static void concatfs_symlink(fuse_req_t req, const char * link,
+			     fuse_ino_t parent, const char * name)
 {
+	char path[PATH_MAX];
 	int rv;
-	char fpath[PATH_MAX];
-	char ftopath[PATH_MAX];
 
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
-	snprintf(ftopath, sizeof(ftopath), "%s/%s", src_dir, topath);
-	
-	rv = rename(fpath, ftopath);
-	if (rv < 0) {
-		return -errno;
+	rv = node_child_path(node_get(parent), name, path, sizeof(path));
+
+	if (rv == 0 && symlinkat(link, src_fd, path) < 0) {
+		rv = -errno;
 	}
-	return rv;
+
+	reply_created(req, node_get(parent), name, rv);
 }
 
-static int concatfs_link(const char *path, const char *topath)
+static void concatfs_link(fuse_req_t req, fuse_ino_t ino,
+			  fuse_ino_t newparent, const char * newname)
 {
+	char path[PATH_MAX];
+	char topath[PATH_MAX];
 	int rv;
-	char fpath[PATH_MAX];
-	char ftopath[PATH_MAX];
 
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
-	snprintf(ftopath, sizeof(ftopath), "%s/%s", src_dir, topath);
-	
-	rv = link(fpath, ftopath);
-	if (rv < 0) {
-		return -errno;
+	rv = node_path(node_get(ino), path, sizeof(path));
+
+	if (rv == 0) {
+		rv = node_child_path(node_get(newparent), newname,
+				     topath, sizeof(topath));
 	}
-	return rv;
+
+	if (rv == 0 && linkat(src_fd, path, src_fd, topath, 0) < 0) {
+		rv = -errno;
+	}
+
+	reply_created(req, node_get(newparent), newname, rv);
 }
 
-static int concatfs_chmod(const char *path, mode_t mode)
+/* unlinkat for name in parent, flags as for unlinkat */
+static void node_unlinkat(fuse_req_t req, fuse_ino_t parent,
+			  const char * name, int flags)
 {
+	char path[PATH_MAX];
 	int rv;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
 
-	rv = chmod(fpath, mode);
-	if (rv < 0) {
-		return -errno;
+	rv = node_child_path(node_get(parent), name, path, sizeof(path));
+
+	if (rv == 0 && unlinkat(src_fd, path, flags) < 0) {
+		rv = -errno;
 	}
-	return rv;
+
+	if (rv == 0) {
+		node_remove(node_get(parent), name);
+	}
+
+	fuse_reply_err(req, -rv);
 }
 
-static int concatfs_chown(const char *path, uid_t uid, gid_t gid)
+static void concatfs_unlink(fuse_req_t req, fuse_ino_t parent,
+			    const char * name)
 {
-	int rv;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
+	node_unlinkat(req, parent, name, 0);
+}
 
-	rv = chown(fpath, uid, gid);
-	if (rv < 0) {
-		return -errno;
-	}
-	return rv;
+static void concatfs_rmdir(fuse_req_t req, fuse_ino_t parent,
+			   const char * name)
+{
+	node_unlinkat(req, parent, name, AT_REMOVEDIR);
 }
 
-static int concatfs_truncate(const char *path, off_t nsize)
+static void concatfs_rename(fuse_req_t req, fuse_ino_t parent,
+			    const char * name, fuse_ino_t newparent,
+			    const char * newname, unsigned int flags)
 {
+	char path[PATH_MAX];
+	char topath[PATH_MAX];
 	int rv;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
 
-	rv = truncate(fpath, nsize);
-	if (rv < 0) {
-		return -errno;
+	rv = node_child_path(node_get(parent), name, path, sizeof(path));
+
+	if (rv == 0) {
+		rv = node_child_path(node_get(newparent), newname,
+				     topath, sizeof(topath));
 	}
-	return rv;
+
+	if (rv == 0 && renameat2(src_fd, path, src_fd, topath, flags) < 0) {
+		rv = -errno;
+	}
+
+	if (rv == 0) {
+		node_rename(node_get(parent), name, node_get(newparent),
+			    newname, flags);
+	}
+
+	fuse_reply_err(req, -rv);
 }
 
-static int concatfs_utime(const char *path, struct utimbuf * buf)
+static void concatfs_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
+	struct node * n = node_get(ino);
+	char path[PATH_MAX];
 	int rv;
-	char fpath[PATH_MAX];
-    
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
 
-	rv = utime(fpath, buf);
-	if (rv < 0) {
-		return -errno;
+	if (n->kind != NODE_SOURCE) {
+		fuse_reply_err(req, (mask & W_OK) ? EACCES : 0);
+		return;
 	}
-	return rv;
+
+	rv = node_path(n, path, sizeof(path));
+
+	if (rv == 0 && faccessat(src_fd, path, mask, 0) < 0) {
+		rv = -errno;
+	}
+
+	fuse_reply_err(req, -rv);
 }
 
-static int concatfs_access(const char *path, int mask)
+static void concatfs_create(fuse_req_t req, fuse_ino_t parent,
+			    const char * name, mode_t mode,
+			    struct fuse_file_info * fi)
 {
+	struct fuse_entry_param e;
+	char path[PATH_MAX];
+	struct node * n;
+	int fd;
 	int rv;
-	char fpath[PATH_MAX];
-   
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
-    
-	rv = access(fpath, mask);
-    
-	if (rv < 0) {
-		return -errno;
+
+	rv = node_child_path(node_get(parent), name, path, sizeof(path));
+
+	if (rv) {
+		fuse_reply_err(req, -rv);
+		return;
 	}
-    
-	return rv;
-}
 
-static int concatfs_create(
-	const char *path, mode_t mode, struct fuse_file_info *fi)
-{
-	int fd = 0;
-	char fpath[PATH_MAX];
-   
-	snprintf(fpath, sizeof(fpath), "%s/%s", src_dir, path);
-    
-	fd = creat(fpath, mode);
-    
+	fd = openat(src_fd, path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+
 	if (fd < 0) {
-		return -errno;
+		fuse_reply_err(req, errno);
+		return;
 	}
 
-	fi->fh = fd;
-    
-	return 0;
+	rv = node_entry(node_get(parent), name, &e);
+
+	if (rv) {
+		close(fd);
+		fuse_reply_err(req, -rv);
+		return;
+	}
+
+	n = node_get(e.ino);
+	rv = open_handle(req, n, fd, path, fi);
+
+	if (rv) {
+		node_forget(n, 1);
+		fuse_reply_err(req, -rv);
+	} else if (fuse_reply_create(req, &e, fi) != 0) {
+		release_handle(0, n, fi);
+	}
 }
 
+/* called in the daemon, so threads started here survive daemonizing */
+static void concatfs_init(void * userdata, struct fuse_conn_info * conn)
+{
+	pthread_t t;
+
+	/* lets fuse_reply_data splice chunk fds into /dev/fuse */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	}
+
+	if (options.prefetch > 0) {
+		pthread_create(&t, NULL, prefetch_worker, NULL);
+		pthread_detach(t);
+	}
+
+	/* also used for stat'ing manifest entries, so even with io=sync */
+	task_pool_start(&io_pool, options.io_threads);
+
+	if (options.watch) {
+		watch_fd = inotify_init1(IN_CLOEXEC);
+
+		if (watch_fd < 0) {
+			perror("inotify_init1");
+		} else {
+			pthread_create(&t, NULL, watch_worker, NULL);
+			pthread_detach(t);
+		}
+	}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (options.passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH)) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		passthrough_on = 1;
+	}
+#endif
+
+	/* after the watcher is up, so it sees the manifests loaded */
+	if (options.warm) {
+		pthread_create(&t, NULL, warm_worker, NULL);
+		pthread_detach(t);
+	}
+}
 
-static struct fuse_operations concatfs_oper = {
+static struct fuse_lowlevel_ops concatfs_oper = {
+	.init		= concatfs_init,
+	.lookup		= concatfs_lookup,
+	.forget		= concatfs_forget,
+	.forget_multi	= concatfs_forget_multi,
 	.getattr	= concatfs_getattr,
+	.setattr	= concatfs_setattr,
 	.readlink       = concatfs_readlink,
 	.mknod          = concatfs_mknod,
 	.mkdir          = concatfs_mkdir,
@@ -644,27 +8470,93 @@ static struct fuse_operations concatfs_oper = {
 	.symlink        = concatfs_symlink,
 	.rename         = concatfs_rename,
 	.link           = concatfs_link,
-	.chmod          = concatfs_chmod,
-	.chown          = concatfs_chown,
-	.truncate       = concatfs_truncate,
-	.utime          = concatfs_utime,
 	.open		= concatfs_open,
 	.read		= concatfs_read,
 	.write          = concatfs_write,
+	.lseek          = concatfs_lseek,
+	.copy_file_range = concatfs_copy_file_range,
+	.getxattr       = concatfs_getxattr,
+	.listxattr      = concatfs_listxattr,
 	.release        = concatfs_release,
+	.opendir	= concatfs_opendir,
 	.readdir	= concatfs_readdir,
+	.readdirplus	= concatfs_readdirplus,
+	.releasedir	= concatfs_releasedir,
 	.access         = concatfs_access,
 	.create         = concatfs_create,
 };
 
 static void usage()
 {
-	fprintf(stderr, "Usage: poc_concatfs src-dir fuse-mount-options...\n");
+	fprintf(stderr, "Usage: poc_concatfs src-dir fuse-mount-options...\n"
+		"       poc_concatfs --compile manifest...\n"
+		"\n"
+		"concatfs options:\n"
+		"    -o chunk_ttl=N    re-stat chunks of cached manifests "
+		"every N seconds (1)\n"
+		"    -o max_chunk_fds=N  keep at most N chunk files open "
+		"(half of RLIMIT_NOFILE)\n"
+		"    -o prefetch=N     prefetch N MiB across chunk boundaries "
+		"on sequential reads (4)\n"
+		"    -o io=MODE        read requests spanning several chunks "
+		"one chunk after another (sync),\n"
+		"                      in parallel on a thread pool (pool) "
+		"or batched in io_uring (uring)\n"
+		"    -o io_threads=N   threads for parallel chunk reads and "
+		"manifest stats (16)\n"
+		"    -o mmap           serve reads from mappings of the chunk "
+		"files\n"
+		"    -o hash_index=FILE  keep chunk digests in FILE "
+		"across mounts\n"
+		"    -o watch          invalidate cached manifests on inotify "
+		"events\n"
+		"    -o attr_timeout=N  cache attributes for N seconds "
+		"(chunk_ttl)\n"
+		"    -o entry_timeout=N  cache names for N seconds "
+		"(chunk_ttl)\n"
+		"    -o zstd_cache=N   keep up to N MiB of decompressed zstd "
+		"frames (64)\n"
+		"    -o block_cache=N  cache up to N MiB of chunk blocks for "
+		"random reads (0)\n"
+		"    -o remote_cache=DIR  cache remote chunks in DIR\n"
+		"    -o remote_ttl=N   re-check remote chunks every N seconds "
+		"(60)\n"
+		"    -o remote_conns=N  keep N idle connections to remote "
+		"servers (16)\n"
+		"    -o s3_endpoint=URL  fetch s3:// chunks from URL "
+		"(https://s3.amazonaws.com)\n"
+		"    -o state_file=FILE  keep the manifest cache in FILE "
+		"across restarts\n"
+		"    -o warm           load all manifests into the cache "
+		"at mount\n"
+		"    -o passthrough    let the kernel read plain and "
+		"single chunk files\n"
+		"\n"
+		"\n"
+		"FUSE worker options:\n"
+		"    -o max_threads=N  at most N worker threads "
+		"(twice the number of cpus, at least 10)\n"
+		"    -o max_idle_threads=N  keep at most N idle worker threads\n"
+		"    -s                single threaded\n"
+		"\n"
+		"clone_fd is on by default.\n");
 	exit(-1);
 }
 
+/* enough FUSE workers to keep every core busy while others block */
+static long max_threads_default()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+
+	return n > 10 ? n : 10;
+}
+
 int main(int argc, char **argv)
 {
+	struct fuse_cmdline_opts cmdline;
+	struct fuse_session * se;
+	int rv;
+
 	if (argc < 3) {
 		usage();
 	}
@@ -676,24 +8568,175 @@ int main(int argc, char **argv)
 			"as root!");
 	}
 
-	if (argv[1][0] == '/') {
-		strncpy(src_dir, argv[1], sizeof(src_dir));
-	} else {
-		char cwd[PATH_MAX];
+	pthread_mutex_init(&manifest_lock, NULL);
+	pthread_mutex_init(&fd_pool_lock, NULL);
+	pthread_mutex_init(&prefetch_lock, NULL);
+	pthread_cond_init(&prefetch_cond, NULL);
+	task_pool_init(&io_pool);
+	task_pool_init(&digest_pool);
+	pthread_key_create(&uring_key, uring_free);
+	pthread_mutex_init(&stats_lock, NULL);
+	pthread_key_create(&stats_key, thread_stats_retire);
+	pthread_key_create(&deferred_pins_key, deferred_pins_free);
+	pthread_mutex_init(&hash_lock, NULL);
+	pthread_mutex_init(&watch_lock, NULL);
+	pthread_mutex_init(&node_lock, NULL);
+	pthread_mutex_init(&zstd_lock, NULL);
+	pthread_mutex_init(&remote_lock, NULL);
+#ifdef HAVE_ZSTD
+	pthread_key_create(&zstd_key, zstd_dctx_free);
+#endif
+
+	if (strcmp(argv[1], "--compile") == 0) {
+		return compile_manifests(argc - 2, argv + 2);
+	}
 
-		getcwd(cwd, sizeof(cwd));
+	src_fd = open(argv[1], O_PATH | O_DIRECTORY);
 
-		snprintf(src_dir, sizeof(src_dir), "%s/%s",
-			 cwd, argv[1]);
+	if (src_fd < 0) {
+		perror(argv[1]);
+		return 1;
 	}
 
-	pthread_mutex_init(&the_lock, NULL);
-
 	char ** argv_ = (char**) calloc(argc, sizeof(char*));
 
 	argv_[0] = argv[0];
 
 	memcpy(argv_ + 1, argv + 2, (argc - 2) * sizeof(char*));
 
-	return fuse_main(argc - 1, argv_, &concatfs_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv_);
+
+	if (fuse_opt_parse(&args, &options, concatfs_opts, NULL) == -1) {
+		usage();
+	}
+
+	/* ahead of the user's options, so those still override them */
+	char defaults[128];
+
+	snprintf(defaults, sizeof(defaults), "-oclone_fd,max_threads=%ld",
+		 max_threads_default());
+
+	fuse_opt_insert_arg(&args, 1, defaults);
+
+	if (fuse_parse_cmdline(&args, &cmdline) != 0 || cmdline.show_help
+	    || !cmdline.mountpoint) {
+		usage();
+	}
+
+	if (!options.io || strcmp(options.io, "sync") == 0) {
+		io_mode = IO_SYNC;
+	} else if (strcmp(options.io, "pool") == 0) {
+		io_mode = IO_POOL;
+	} else if (strcmp(options.io, "uring") == 0) {
+		io_mode = IO_URING;
+	} else {
+		usage();
+	}
+
+	if (options.use_mmap) {
+		mmap_fault_init();
+	}
+
+	block_cache_init(options.block_cache);
+
+	if (options.attr_timeout < 0) {
+		options.attr_timeout = options.chunk_ttl;
+	}
+	if (options.entry_timeout < 0) {
+		options.entry_timeout = options.chunk_ttl;
+	}
+
+	/* opened before fuse_daemonize changes to / */
+	if (options.hash_index) {
+		int err = hash_index_open(options.hash_index);
+
+		if (err) {
+			fprintf(stderr, "%s: %s\n", options.hash_index,
+				strerror(-err));
+			return 1;
+		}
+	}
+
+	if (options.state_file) {
+		int err = state_load(options.state_file);
+
+		if (err) {
+			fprintf(stderr, "%s: %s\n", options.state_file,
+				strerror(-err));
+			return 1;
+		}
+	}
+
+	if (options.remote_cache) {
+		int err = remote_cache_open(options.remote_cache);
+
+		if (err) {
+			fprintf(stderr, "%s: %s\n", options.remote_cache,
+				strerror(-err));
+			return 1;
+		}
+	}
+
+#ifdef HAVE_CURL
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	remote_idle = (CURL **) calloc(sizeof(CURL *),
+				       options.remote_conns + 1);
+#endif
+
+	if (options.max_chunk_fds == 0) {
+		struct rlimit rl;
+
+		getrlimit(RLIMIT_NOFILE, &rl);
+		options.max_chunk_fds = rl.rlim_cur / 2;
+	}
+
+	se = fuse_session_new(&args, &concatfs_oper, sizeof(concatfs_oper),
+			      NULL);
+
+	if (!se) {
+		return 1;
+	}
+
+	if (fuse_session_mount(se, cmdline.mountpoint) != 0) {
+		fuse_session_destroy(se);
+		return 1;
+	}
+
+	fuse_daemonize(cmdline.foreground);
+
+	concatfs_se = se;
+	fuse_set_signal_handlers(se);
+
+	if (cmdline.singlethread) {
+		rv = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config * cfg = fuse_loop_cfg_create();
+
+		/* each worker reads requests from its own /dev/fuse clone */
+		fuse_loop_cfg_set_clone_fd(cfg, cmdline.clone_fd);
+		fuse_loop_cfg_set_max_threads(cfg, cmdline.max_threads);
+		fuse_loop_cfg_set_idle_threads(cfg, cmdline.max_idle_threads);
+
+		rv = fuse_session_loop_mt(se, cfg);
+
+		fuse_loop_cfg_destroy(cfg);
+	}
+
+	fuse_remove_signal_handlers(se);
+	fuse_session_unmount(se);
+	fuse_session_destroy(se);
+
+	if (options.state_file) {
+		int err = state_save();
+
+		if (err) {
+			fprintf(stderr, "%s: %s\n", options.state_file,
+				strerror(-err));
+		}
+	}
+
+	free(cmdline.mountpoint);
+	fuse_opt_free_args(&args);
+
+	return rv ? 1 : 0;
 }